@@ -0,0 +1,171 @@
+#ifndef V8_INTERPRETER_BINDINGSTATS_H
+#define V8_INTERPRETER_BINDINGSTATS_H
+
+#include <string>
+#include <vector>
+
+///
+/// Per binding call counters and latency histograms, enabled by building with
+/// V8_BINDING_STATS. Each thread counts into its own buffer without locking;
+/// BindingStats::collect() merges all threads. When disabled, the timing scope
+/// compiles to nothing and bindings get no id.
+///
+
+#ifdef V8_BINDING_STATS
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+class BindingStats {
+public:
+	// Bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds
+	static const int Buckets = 32;
+
+	struct Report {
+		std::string name;
+		uint64_t calls;
+		uint64_t totalNs;
+		uint64_t histogram[Buckets];
+	};
+
+	static int registerBinding(const std::string &name) {
+		std::lock_guard<std::mutex> guard(registry().m);
+		auto &names = registry().names;
+		if((int)names.size() >= ChunkSize * MaxChunks)
+			return -1;
+		names.push_back(name);
+		return names.size() - 1;
+	}
+
+	static void record(int id, uint64_t ns) {
+		auto &c = local().get(id);
+		int b = log2(ns);
+		add(c.calls, 1);
+		add(c.totalNs, ns);
+		add(c.buckets[b < Buckets ? b : Buckets - 1], 1);
+	}
+
+	// Merge the counters of all threads, one report per binding that has been called
+	static std::vector<Report> collect() {
+		std::lock_guard<std::mutex> guard(registry().m);
+		auto &r = registry();
+		std::vector<Report> result;
+		for(size_t id = 0; id < r.names.size(); id++) {
+			Report report { r.names[id], 0, 0, {} };
+			for(auto *t : r.threads) {
+				auto *chunk = t->chunks[id / ChunkSize].load(std::memory_order_acquire);
+				if(!chunk)
+					continue;
+				auto &c = chunk[id % ChunkSize];
+				report.calls += c.calls.load(std::memory_order_relaxed);
+				report.totalNs += c.totalNs.load(std::memory_order_relaxed);
+				for(int b = 0; b < Buckets; b++)
+					report.histogram[b] += c.buckets[b].load(std::memory_order_relaxed);
+			}
+			if(report.calls)
+				result.push_back(report);
+		}
+		return result;
+	}
+
+private:
+	static const int ChunkSize = 64;
+
+	// Only the owning thread writes a counter, so no read-modify-write is needed
+	static void add(std::atomic<uint64_t> &counter, uint64_t n) {
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	static int log2(uint64_t n) {
+		if(!n)
+			return 0;
+#if defined(__GNUC__) || defined(__clang__)
+		return 63 - __builtin_clzll(n);
+#else
+		int b = 0;
+		while(n >>= 1)
+			b++;
+		return b;
+#endif
+	}
+	static const int MaxChunks = 64;
+
+	struct Counters {
+		std::atomic<uint64_t> calls { 0 };
+		std::atomic<uint64_t> totalNs { 0 };
+		std::atomic<uint64_t> buckets[Buckets] {};
+	};
+
+	// Counters owned by one thread. Chunks are allocated by the owner as new ids are
+	// seen, and published atomically so collect() can read them at any time.
+	struct ThreadCounters {
+		ThreadCounters() {
+			for(auto &c : chunks)
+				c.store(nullptr, std::memory_order_relaxed);
+		}
+		Counters &get(int id) {
+			auto &slot = chunks[id / ChunkSize];
+			auto *chunk = slot.load(std::memory_order_relaxed);
+			if(!chunk) {
+				chunk = new Counters[ChunkSize];
+				slot.store(chunk, std::memory_order_release);
+			}
+			return chunk[id % ChunkSize];
+		}
+		std::atomic<Counters*> chunks[MaxChunks];
+	};
+
+	struct Registry {
+		std::mutex m;
+		std::vector<std::string> names;
+		// Never freed, so counts from threads that have exited are kept
+		std::vector<ThreadCounters*> threads;
+	};
+
+	static Registry &registry() {
+		static Registry r;
+		return r;
+	}
+
+	static ThreadCounters &local() {
+		static thread_local ThreadCounters *t = nullptr;
+		if(!t) {
+			t = new ThreadCounters();
+			std::lock_guard<std::mutex> guard(registry().m);
+			registry().threads.push_back(t);
+		}
+		return *t;
+	}
+};
+
+// Times the enclosing scope and records it for a binding
+struct BindingTimer {
+	using Clock = std::chrono::steady_clock;
+	BindingTimer(int id) : id(id), start(id >= 0 ? Clock::now() : Clock::time_point()) {}
+	~BindingTimer() {
+		if(id >= 0)
+			BindingStats::record(id, std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+	}
+	int id;
+	Clock::time_point start;
+};
+
+#define BINDING_STATS_SCOPE(id) BindingTimer binding_timer_(id)
+
+inline int bindingStatsId(const std::string &name) {
+	return BindingStats::registerBinding(name);
+}
+
+#else
+
+#define BINDING_STATS_SCOPE(id)
+
+inline int bindingStatsId(const std::string &name) {
+	return -1;
+}
+
+#endif
+
+#endif // V8_INTERPRETER_BINDINGSTATS_H
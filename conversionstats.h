@@ -0,0 +1,107 @@
+#ifndef V8_INTERPRETER_CONVERSIONSTATS_H
+#define V8_INTERPRETER_CONVERSIONSTATS_H
+
+#include "v8common.h"
+
+#include <string>
+#include <vector>
+
+///
+/// Per C++ type accounting of the conversions in v8cast.h, enabled by building with
+/// V8_CONVERSION_STATS. Counts conversions in each direction, bytes copied, JS
+/// wrappers created and heap allocations, to show where conversions cost the most.
+///
+
+#ifdef V8_CONVERSION_STATS
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+class ConversionStats {
+public:
+	struct Counters {
+		Counters(const std::string &name) : name(name) {}
+		std::string name;
+		std::atomic<uint64_t> toCpp { 0 };
+		std::atomic<uint64_t> toJs { 0 };
+		std::atomic<uint64_t> bytes { 0 };
+		std::atomic<uint64_t> wrappers { 0 };
+		std::atomic<uint64_t> allocations { 0 };
+	};
+
+	struct Report {
+		std::string type;
+		uint64_t toCpp;
+		uint64_t toJs;
+		uint64_t bytes;
+		uint64_t wrappers;
+		uint64_t allocations;
+	};
+
+	enum SortBy { Conversions, Bytes, Wrappers, Allocations };
+
+	template <typename T> static Counters &of() {
+		static Counters *c = add(demangle(typeid(T).name()));
+		return *c;
+	}
+
+	// The `count` types with the highest cost by the given measure
+	static std::vector<Report> top(size_t count = 10, SortBy sortBy = Bytes) {
+		std::vector<Report> result;
+		{
+			std::lock_guard<std::mutex> guard(registry().m);
+			for(auto *c : registry().types) {
+				result.push_back(Report { c->name, c->toCpp.load(), c->toJs.load(), c->bytes.load(), c->wrappers.load(), c->allocations.load() });
+			}
+		}
+		auto key = [=](const Report &r) -> uint64_t {
+			switch(sortBy) {
+			case Conversions: return r.toCpp + r.toJs;
+			case Wrappers: return r.wrappers;
+			case Allocations: return r.allocations;
+			default: return r.bytes;
+			}
+		};
+		std::sort(result.begin(), result.end(), [&](const Report &a, const Report &b) { return key(a) > key(b); });
+		if(result.size() > count)
+			result.resize(count);
+		return result;
+	}
+
+	static void write(std::ostream &os, size_t count = 10, SortBy sortBy = Bytes) {
+		os << "type\tto_cpp\tto_js\tbytes\twrappers\tallocations\n";
+		for(auto &r : top(count, sortBy))
+			os << r.type << "\t" << r.toCpp << "\t" << r.toJs << "\t" << r.bytes << "\t" << r.wrappers << "\t" << r.allocations << "\n";
+	}
+
+private:
+	struct Registry {
+		std::mutex m;
+		std::vector<Counters*> types;
+	};
+
+	static Registry &registry() {
+		static Registry r;
+		return r;
+	}
+
+	static Counters *add(const std::string &name) {
+		auto *c = new Counters(name);
+		std::lock_guard<std::mutex> guard(registry().m);
+		registry().types.push_back(c);
+		return c;
+	}
+};
+
+#define CONVERSION_STAT(T, counter, n) ConversionStats::of<T>().counter.fetch_add(n, std::memory_order_relaxed)
+
+#else
+
+#define CONVERSION_STAT(T, counter, n)
+
+#endif
+
+#endif // V8_INTERPRETER_CONVERSIONSTATS_H
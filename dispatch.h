@@ -2,6 +2,7 @@
 #define COREUTILS_DISPATCH_H
 
 #include <functional>
+#include <tuple>
 
 #if __cplusplus <= 201200L
 
@@ -26,9 +27,24 @@ struct make_index_sequence<0u, Is...> : index_sequence<Is...> { using type = ind
 
 #endif
 
+// Return and argument types of a callable, for building signatures at registration time
+template <typename FX> struct FunctionTraits : public FunctionTraits<decltype(&FX::operator())> {};
+
+template <class RET, class... ARGS> struct FunctionTraits<RET (*)(ARGS...)> {
+	using Return = RET;
+	using Args = std::tuple<ARGS...>;
+	static constexpr size_t arity = sizeof...(ARGS);
+};
+
+template <class CLASS, class RET, class... ARGS> struct FunctionTraits<RET (CLASS::*)(ARGS...)> : public FunctionTraits<RET (*)(ARGS...)> {};
+template <class CLASS, class RET, class... ARGS> struct FunctionTraits<RET (CLASS::*)(ARGS...) const> : public FunctionTraits<RET (*)(ARGS...)> {};
+
 // Type erased base class
 template <typename CALLINFO> struct FunctionCaller {
+	virtual ~FunctionCaller() {}
 	virtual int call(CALLINFO &ci) = 0;
+	// Id used for call statistics, -1 if not counted
+	int statsId = -1;
 };
 
 template<typename... X> struct FunctionCallerFunctor;
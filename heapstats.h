@@ -0,0 +1,93 @@
+#ifndef V8_INTERPRETER_HEAPSTATS_H
+#define V8_INTERPRETER_HEAPSTATS_H
+
+#include "v8common.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct HeapSpaceInfo {
+	std::string name;
+	size_t size;
+	size_t used;
+	size_t available;
+	size_t physical;
+};
+
+struct HeapInfo {
+	size_t totalHeapSize;
+	size_t totalHeapSizeExecutable;
+	size_t totalPhysicalSize;
+	size_t usedHeapSize;
+	size_t heapSizeLimit;
+	std::vector<HeapSpaceInfo> spaces;
+};
+
+// What V8Interpreter::idle() got done
+struct IdleWork {
+	// Idle tasks run, as posted by V8 to the platform
+	int tasks = 0;
+	// Contexts created to refill the pool of warmContexts()
+	int contexts = 0;
+	// Garbage collections during the idle period
+	uint64_t collections = 0;
+	size_t freedBytes = 0;
+	double seconds = 0;
+	// True if V8 reported that it has no more idle work to do
+	bool done = false;
+};
+
+///
+/// \brief GC pause times by GC type
+/// Filled in by GC prologue/epilogue callbacks on the isolate thread. Counters are
+/// atomic so they can be read from a metrics thread.
+///
+struct GCStats {
+	static const int Types = 4;
+	static const int Buckets = 10;
+
+	// Upper bounds of the histogram buckets in seconds, the last one is +Inf
+	static const double *bucketLimits() {
+		static const double limits[Buckets] = { 0.0001, 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 1e300 };
+		return limits;
+	}
+
+	static const char *typeName(int type) {
+		static const char *names[Types] = { "scavenge", "mark_sweep_compact", "incremental_marking", "weak_callbacks" };
+		return names[type];
+	}
+
+	// GCType is a bit mask with one bit per type
+	static int typeIndex(v8::GCType type) {
+		for(int i = 0; i < Types; i++) {
+			if(type & (1 << i))
+				return i;
+		}
+		return 0;
+	}
+
+	void begin(v8::GCType type) {
+		start[typeIndex(type)] = std::chrono::steady_clock::now();
+	}
+
+	void end(v8::GCType type) {
+		int t = typeIndex(type);
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start[t]).count();
+		count[t]++;
+		totalUs[t] += us;
+		int b = 0;
+		while(b < Buckets - 1 && us / 1000000.0 > bucketLimits()[b])
+			b++;
+		buckets[t][b]++;
+	}
+
+	std::chrono::steady_clock::time_point start[Types];
+	std::atomic<uint64_t> count[Types] {};
+	std::atomic<uint64_t> totalUs[Types] {};
+	std::atomic<uint64_t> buckets[Types][Buckets] {};
+};
+
+#endif // V8_INTERPRETER_HEAPSTATS_H
@@ -0,0 +1,148 @@
+#ifndef V8_INTERPRETER_JSFUNCTION_H
+#define V8_INTERPRETER_JSFUNCTION_H
+
+#include "v8common.h"
+#include "v8cast.h"
+
+#include <functional>
+#include <vector>
+
+template <typename F> class JSFunction;
+
+///
+/// \brief The JSFunction class
+/// Typed handle to a javascript function that can be called from C++. The function and
+/// its context are kept in persistent handles so a call does not resolve or compile anything.
+///
+template <typename R, typename... ARGS> class JSFunction<R(ARGS...)> {
+public:
+	using FunctionHandle = v8::Persistent<v8::Function, v8::CopyablePersistentTraits<v8::Function>>;
+	using ContextHandle = v8::Persistent<v8::Context, v8::CopyablePersistentTraits<v8::Context>>;
+
+	JSFunction() {}
+
+	JSFunction(v8::Isolate *isolate, v8::Local<v8::Context> c, v8::Local<v8::Function> f) : isolate(isolate), context(isolate, c), function(isolate, f) {}
+
+	// A JSObject result is kept in the caller's HandleScope
+	R operator()(ARGS... args) const {
+		JSResultScope<R> scope(isolate, context);
+		return to_cpp<R>(scope.result(call(args...)));
+	}
+
+	// Call with the caller responsible for the isolate, HandleScope and context.
+	// Used when calling many times in a row. A JS exception throws v8_exception,
+	// except when called from inside a native callback. Then it is rethrown to the
+	// calling script once the callback returns, and the result is undefined.
+	v8::Local<v8::Value> call(ARGS... args) const {
+		using namespace v8;
+		// One extra element so the array is never zero sized
+		Local<Value> arg_array[sizeof...(ARGS) + 1] = { to_js(isolate, args)... };
+		auto f = Local<Function>::New(isolate, function);
+		TryCatch tc(isolate);
+		ScriptEntry entry(isolate);
+		auto result = f->Call(Undefined(isolate), sizeof...(ARGS), arg_array);
+		entry.check();
+		if(tc.HasCaught()) {
+			// A C++ exception must not unwind through the V8 frames of the caller
+			if(entry.nested()) {
+				if(tc.CanContinue())
+					tc.ReThrow();
+				return Undefined(isolate);
+			}
+			throw v8_exception(to_cpp<std::string>(tc.Exception()));
+		}
+		return result;
+	}
+
+	bool empty() const {
+		return function.IsEmpty();
+	}
+
+	v8::Isolate *getIsolate() const {
+		return isolate;
+	}
+
+	const ContextHandle &getContext() const {
+		return context;
+	}
+
+private:
+	v8::Isolate *isolate = nullptr;
+	ContextHandle context;
+	FunctionHandle function;
+};
+
+template <typename F> class JSExpression;
+
+///
+/// \brief The JSExpression class
+/// A JS expression over numeric parameters, compiled once into a function. Call it
+/// like a JSFunction for single values, or use batch() to evaluate whole columns.
+///
+template <typename R, typename... ARGS> class JSExpression<R(ARGS...)> : public JSFunction<R(ARGS...)> {
+public:
+	using FunctionHandle = typename JSFunction<R(ARGS...)>::FunctionHandle;
+
+	JSExpression() {}
+
+	JSExpression(v8::Isolate *isolate, v8::Local<v8::Context> c, v8::Local<v8::Function> f, v8::Local<v8::Function> batchFn) : JSFunction<R(ARGS...)>(isolate, c, f), batchFunction(isolate, batchFn) {}
+
+	// Evaluate `n` rows, taking parameter values from the columns and writing
+	// results to `out`. The columns are passed to JS as typed arrays over the C++
+	// memory and the loop runs in JS, so there is one call into JS per batch.
+	void batch(size_t n, R *out, const ARGS*... columns) const {
+		using namespace v8;
+		auto *isolate = this->getIsolate();
+		JSCallScope scope(isolate, this->getContext());
+
+		std::vector<double> results(n);
+		Local<TypedArray> arrays[] = { JSTypedArray<double>::wrap(isolate, results.data(), n), JSTypedArray<ARGS>::wrap(isolate, const_cast<ARGS*>(columns), n)... };
+		Local<Value> arg_array[sizeof...(ARGS) + 2];
+		arg_array[0] = Number::New(isolate, n);
+		for(size_t i = 0; i <= sizeof...(ARGS); i++)
+			arg_array[i + 1] = arrays[i];
+
+		auto f = Local<Function>::New(isolate, batchFunction);
+		TryCatch tc(isolate);
+		{
+			ScriptEntry entry(isolate);
+			f->Call(Undefined(isolate), sizeof...(ARGS) + 2, arg_array);
+			// Make sure scripts can not hold on to the C++ memory
+			for(auto &a : arrays)
+				a->Buffer()->Neuter();
+			entry.check();
+		}
+		if(tc.HasCaught())
+			throw v8_exception(to_cpp<std::string>(tc.Exception()));
+
+		for(size_t i = 0; i < n; i++)
+			out[i] = static_cast<R>(results[i]);
+	}
+
+private:
+	FunctionHandle batchFunction;
+};
+
+// Cast Javascript function to JSFunction
+template <typename R, typename... ARGS> struct JSValue<JSFunction<R(ARGS...)>> {
+	static JSFunction<R(ARGS...)> cast(const v8::Local<v8::Value> &v) {
+		using namespace v8;
+		auto *isolate = Isolate::GetCurrent();
+		if(!v->IsFunction())
+			throw v8_exception("Not a function");
+		return JSFunction<R(ARGS...)>(isolate, isolate->GetCurrentContext(), Local<Function>::Cast(v));
+	}
+};
+
+// Cast Javascript function to std::function
+template <typename R, typename... ARGS> struct JSValue<std::function<R(ARGS...)>> {
+	static std::function<R(ARGS...)> cast(const v8::Local<v8::Value> &v) {
+		return JSValue<JSFunction<R(ARGS...)>>::cast(v);
+	}
+};
+
+template <typename F> struct JSArgType<JSFunction<F>> {
+	static bool matches(const v8::Local<v8::Value> &v) { return v->IsFunction(); }
+};
+
+#endif // V8_INTERPRETER_JSFUNCTION_H
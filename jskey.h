@@ -0,0 +1,103 @@
+#ifndef V8_INTERPRETER_JSKEY_H
+#define V8_INTERPRETER_JSKEY_H
+
+#include "v8common.h"
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class JSKey;
+
+///
+/// \brief The JSKeyCache class
+/// Per isolate cache of internalized property name strings, so repeated lookups of
+/// the same name do not create a new V8 string every time. Entries are never
+/// removed, so only JSKeys and names of registered bindings are cached.
+///
+class JSKeyCache {
+public:
+	static JSKeyCache &get(v8::Isolate *isolate) {
+		auto *kc = static_cast<JSKeyCache*>(isolate->GetData(KeyCacheSlot));
+		if(!kc) {
+			kc = new JSKeyCache();
+			isolate->SetData(KeyCacheSlot, kc);
+		}
+		return *kc;
+	}
+
+	// Free the cache of an isolate about to be disposed
+	static void release(v8::Isolate *isolate) {
+		delete static_cast<JSKeyCache*>(isolate->GetData(KeyCacheSlot));
+		isolate->SetData(KeyCacheSlot, nullptr);
+	}
+
+	v8::Local<v8::String> key(v8::Isolate *isolate, const std::string &name) {
+		auto it = keys.find(name);
+		if(it == keys.end())
+			it = keys.emplace(name, v8::Eternal<v8::String>(isolate, internalize(isolate, name.c_str(), name.size()))).first;
+		return it->second.Get(isolate);
+	}
+
+	inline v8::Local<v8::String> key(v8::Isolate *isolate, const JSKey &k);
+
+	static v8::Local<v8::String> internalize(v8::Isolate *isolate, const char *name, int length = -1) {
+		return v8::String::NewFromUtf8(isolate, name, v8::String::kInternalizedString, length);
+	}
+
+private:
+	std::unordered_map<std::string, v8::Eternal<v8::String>> keys;
+	std::vector<v8::Eternal<v8::String>> byId;
+};
+
+///
+/// \brief The JSKey class
+/// A property name known at compile time. Declare it once, as in
+/// `static const JSKey kName("name");`. Each key gets a global id that indexes
+/// the per isolate table directly, so a lookup needs no string creation or hashing.
+///
+class JSKey {
+public:
+	explicit JSKey(const char *name) : name(name), id(nextId()++) {}
+
+	v8::Local<v8::String> get(v8::Isolate *isolate) const {
+		return JSKeyCache::get(isolate).key(isolate, *this);
+	}
+
+	const char *name;
+	const int id;
+
+private:
+	static std::atomic<int> &nextId() {
+		static std::atomic<int> id { 0 };
+		return id;
+	}
+};
+
+v8::Local<v8::String> JSKeyCache::key(v8::Isolate *isolate, const JSKey &k) {
+	if(k.id >= (int)byId.size())
+		byId.resize(k.id + 1);
+	auto &e = byId[k.id];
+	if(e.IsEmpty())
+		e.Set(isolate, internalize(isolate, k.name));
+	return e.Get(isolate);
+}
+
+// Cached internalized string for a name that is used for the life of the isolate,
+// like the name of a registered function or field
+inline v8::Local<v8::String> intern_key(v8::Isolate *isolate, const std::string &name) {
+	return JSKeyCache::get(isolate).key(isolate, name);
+}
+
+// Property name for a one-off lookup. Not cached, since names built from data
+// would fill the cache without bound.
+inline v8::Local<v8::String> to_key(v8::Isolate *isolate, const std::string &name) {
+	return v8::String::NewFromUtf8(isolate, name.c_str(), v8::String::kNormalString, name.size());
+}
+
+inline v8::Local<v8::String> to_key(v8::Isolate *isolate, const JSKey &key) {
+	return key.get(isolate);
+}
+
+#endif // V8_INTERPRETER_JSKEY_H
@@ -3,6 +3,120 @@
 
 #include "v8common.h"
 #include "v8cast.h"
+#include "jskey.h"
+
+#include <atomic>
+#include <tuple>
+#include <vector>
+
+inline uint32_t array_length(const v8::Local<v8::Value> &v) {
+	using namespace v8;
+	if(v->IsArray())
+		return Local<Array>::Cast(v)->Length();
+	if(v->IsTypedArray())
+		return Local<TypedArray>::Cast(v)->Length();
+	throw v8_exception("Not an array");
+}
+
+// Reads all elements of a JS array or typed array into a vector
+template <typename T, typename = void> struct JSArrayReader {
+	static void read(const v8::Local<v8::Value> &v, std::vector<T> &out) {
+		using namespace v8;
+		auto o = Local<Object>::Cast(v);
+		uint32_t n = array_length(v);
+		out.reserve(n);
+		for(uint32_t i = 0; i < n; i++)
+			out.push_back(to_cpp<T>(o->Get(i)));
+	}
+};
+
+// Numbers skip the generic conversion, and typed arrays of the same element
+// type are copied in one go
+template <typename T> struct JSArrayReader<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+	static void read(const v8::Local<v8::Value> &v, std::vector<T> &out) {
+		using namespace v8;
+		if(copyTyped(v, out, std::integral_constant<bool, JSTypedArray<T>::defined>()))
+			return;
+		auto o = Local<Object>::Cast(v);
+		uint32_t n = array_length(v);
+		out.resize(n);
+		for(uint32_t i = 0; i < n; i++) {
+			auto e = o->Get(i);
+			if(e->IsInt32())
+				out[i] = static_cast<T>(Int32::Cast(*e)->Value());
+			else if(e->IsNumber())
+				out[i] = static_cast<T>(Number::Cast(*e)->Value());
+			else
+				out[i] = static_cast<T>(e->NumberValue());
+		}
+	}
+
+	static bool copyTyped(const v8::Local<v8::Value> &v, std::vector<T> &out, std::true_type) {
+		if(!JSTypedArray<T>::is(v))
+			return false;
+		auto ta = v8::Local<v8::TypedArray>::Cast(v);
+		const T *data = JSTypedArray<T>::data(ta);
+		out.assign(data, data + ta->Length());
+		return true;
+	}
+
+	static bool copyTyped(const v8::Local<v8::Value> &v, std::vector<T> &out, std::false_type) {
+		return false;
+	}
+};
+
+///
+/// \brief The JSArray class
+/// The elements of a JS array or typed array, converted to T and copied into
+/// a vector with one allocation.
+///
+template <typename T> class JSArray {
+public:
+	JSArray(const v8::Local<v8::Value> &v) {
+		JSArrayReader<T>::read(v, elements);
+	}
+
+	size_t size() const { return elements.size(); }
+	const T &operator[](size_t i) const { return elements[i]; }
+
+	typename std::vector<T>::const_iterator begin() const { return elements.begin(); }
+	typename std::vector<T>::const_iterator end() const { return elements.end(); }
+
+	const std::vector<T> &vector() const { return elements; }
+	std::vector<T> release() { return std::move(elements); }
+
+private:
+	std::vector<T> elements;
+};
+
+///
+/// \brief The JSKeyView class
+/// A property name that is only converted to a std::string when asked for
+///
+class JSKeyView {
+public:
+	JSKeyView(const v8::Local<v8::Value> &key) : key(key) {}
+
+	std::string str() const {
+		v8::String::Utf8Value utf8(key);
+		return std::string(*utf8, utf8.length());
+	}
+
+	operator std::string() const {
+		return str();
+	}
+
+	bool isIndex() const {
+		return key->IsNumber();
+	}
+
+	v8::Local<v8::Value> value() const {
+		return key;
+	}
+
+private:
+	v8::Local<v8::Value> key;
+};
 
 ///
 /// \brief The JSObject class
@@ -15,9 +129,14 @@ public:
 
 	JSObject operator[](const std::string &field) const {
 		using namespace v8;
-		auto s = to_js(isolate, field);
 		Local<Object> o = Local<Object>::Cast(lv);
-		return JSObject(isolate, o->Get(s));
+		return JSObject(isolate, o->Get(to_key(isolate, field)));
+	}
+
+	JSObject operator[](const JSKey &field) const {
+		using namespace v8;
+		Local<Object> o = Local<Object>::Cast(lv);
+		return JSObject(isolate, o->Get(field.get(isolate)));
 	}
 
 	JSObject operator[](const int &i) const {
@@ -26,6 +145,11 @@ public:
 		return JSObject(isolate, o->Get(i));
 	}
 
+	// Read all elements of an array or typed array at once
+	template <typename T> JSArray<T> as_array() const {
+		return JSArray<T>(lv);
+	}
+
 	bool isObject() const {
 		return lv->IsObject();
 	}
@@ -33,8 +157,13 @@ public:
 	bool hasKey(const std::string &key) const {
 		using namespace v8;
 		Local<Object> o = Local<Object>::Cast(lv);
-		auto s = to_js<std::string, String>(isolate, key);
-		return o->HasOwnProperty(s);
+		return o->HasOwnProperty(to_key(isolate, key));
+	}
+
+	bool hasKey(const JSKey &key) const {
+		using namespace v8;
+		Local<Object> o = Local<Object>::Cast(lv);
+		return o->HasOwnProperty(key.get(isolate));
 	}
 
 	bool isString() const {
@@ -66,6 +195,40 @@ public:
 		return fields->Length();
 	}
 
+	v8::Local<v8::Value> value() const {
+		return lv;
+	}
+
+	v8::Isolate *getIsolate() const {
+		return isolate;
+	}
+
+	struct ExtractResult {
+		std::vector<std::string> missing;
+		std::vector<std::string> mismatched;
+		bool ok() const { return missing.empty() && mismatched.empty(); }
+	};
+
+	// Read several fields into a C++ struct in one pass, as in
+	// `obj.extract(s, &S::a, "a", &S::b, "b")`. Keys can be JSKeys, string literals,
+	// which are cached like JSKeys, or std::strings, which are not.
+	// Fields that are missing or of the wrong type are left untouched and reported.
+	template <typename S, typename... FIELDS> ExtractResult extract(S &target, const FIELDS&... fields) const {
+		ExtractResult result;
+		auto o = v8::Local<v8::Object>::Cast(lv);
+		extractFields(o, target, result, fields...);
+		return result;
+	}
+
+	// Same for a tuple, one key per element, as in `obj.extract(t, "a", "b")`
+	template <typename... T, typename... KEYS> ExtractResult extract(std::tuple<T...> &target, const KEYS&... keys) const {
+		static_assert(sizeof...(T) == sizeof...(KEYS), "Need one key per tuple element");
+		ExtractResult result;
+		auto o = v8::Local<v8::Object>::Cast(lv);
+		extractElements<0>(o, target, result, keys...);
+		return result;
+	}
+
 	template <typename T> T to() {
 		//LOGD("JSObject to %s", type(T));
 		return to_cpp<T>(lv);
@@ -112,13 +275,240 @@ public:
 		getFields();
 		return const_iterator(fields, fields->Length());
 	}
+
+	struct Entry;
+	class entry_iterator;
+	class Entries;
+
+	// Use as `for(auto e : obj.entries()) { e.key; e.value; }`
+	Entries entries() const;
 private:
+	template <typename S> void extractFields(const v8::Local<v8::Object> &o, S &target, ExtractResult &result) const {}
+
+	template <typename S, typename T, typename K, typename... FIELDS> void extractFields(const v8::Local<v8::Object> &o, S &target, ExtractResult &result, T S::* const &ptm, const K &key, const FIELDS&... fields) const {
+		extractField(o, target.*ptm, key, result);
+		extractFields(o, target, result, fields...);
+	}
+
+	template <size_t I, typename TUPLE> void extractElements(const v8::Local<v8::Object> &o, TUPLE &target, ExtractResult &result) const {}
+
+	template <size_t I, typename TUPLE, typename K, typename... KEYS> void extractElements(const v8::Local<v8::Object> &o, TUPLE &target, ExtractResult &result, const K &key, const KEYS&... keys) const {
+		extractField(o, std::get<I>(target), key, result);
+		extractElements<I + 1>(o, target, result, keys...);
+	}
+
+	template <typename T, typename K> void extractField(const v8::Local<v8::Object> &o, T &t, const K &key, ExtractResult &result) const {
+		auto v = o->Get(fieldKey(key));
+		if(v->IsUndefined())
+			result.missing.emplace_back(keyName(key));
+		else if(!readField(v, t))
+			result.mismatched.emplace_back(keyName(key));
+	}
+
+	// String literals name fixed fields, so they go through the key cache. Other
+	// strings may be built from data and are not cached.
+	template <size_t N> v8::Local<v8::String> fieldKey(const char (&key)[N]) const { return intern_key(isolate, key); }
+	v8::Local<v8::String> fieldKey(const std::string &key) const { return to_key(isolate, key); }
+	v8::Local<v8::String> fieldKey(const JSKey &key) const { return key.get(isolate); }
+
+	static std::string keyName(const std::string &key) { return key; }
+	static std::string keyName(const JSKey &key) { return key.name; }
+
+	template <typename T> static is_arithmetic<T, bool> readField(const v8::Local<v8::Value> &v, T &t) {
+		if(!v->IsNumber())
+			return false;
+		t = static_cast<T>(v8::Number::Cast(*v)->Value());
+		return true;
+	}
+
+	static bool readField(const v8::Local<v8::Value> &v, bool &t) {
+		if(!v->IsBoolean())
+			return false;
+		t = v8::Boolean::Cast(*v)->Value();
+		return true;
+	}
+
+	static bool readField(const v8::Local<v8::Value> &v, std::string &t) {
+		if(!v->IsString())
+			return false;
+		v8::String::Utf8Value utf8(v);
+		t.assign(*utf8, utf8.length());
+		return true;
+	}
+
+	template <typename T> static is_not_arithmetic<T, bool> readField(const v8::Local<v8::Value> &v, T &t) {
+		if(!JSArgType<T>::matches(v))
+			return false;
+		t = to_cpp<T>(v);
+		return true;
+	}
+
 	v8::Isolate *isolate;
 	v8::Local<v8::Value> lv;
 	mutable bool fieldInit = false;
 	mutable v8::Local<v8::Array> fields;
 };
 
+///
+/// \brief The JSObjectRef class
+/// A javascript value kept alive by a persistent handle, so it can be stored after
+/// the HandleScope it was created in is gone. Read it through a JSObjectRef::Scope.
+///
+class JSObjectRef {
+public:
+	JSObjectRef() {}
+
+	JSObjectRef(v8::Isolate *isolate, const v8::Local<v8::Value> &v) : isolate(isolate), handle(isolate, v), context(isolate, isolate->GetCurrentContext()), size(shallowSize(v)) {
+		liveCount()++;
+		liveBytes() += size;
+	}
+
+	JSObjectRef(const JSObject &o) : JSObjectRef(o.getIsolate(), o.value()) {}
+
+	JSObjectRef(JSObjectRef &&other) : isolate(other.isolate), handle(std::move(other.handle)), context(std::move(other.context)), size(other.size) {
+		other.size = 0;
+	}
+
+	JSObjectRef &operator=(JSObjectRef &&other) {
+		if(this == &other)
+			return *this;
+		release();
+		isolate = other.isolate;
+		handle = std::move(other.handle);
+		context = std::move(other.context);
+		size = other.size;
+		other.size = 0;
+		return *this;
+	}
+
+	~JSObjectRef() {
+		release();
+	}
+
+	// Let the value be garbage collected
+	void release() {
+		if(!handle.IsEmpty()) {
+			handle.Reset();
+			context.Reset();
+			liveCount()--;
+			liveBytes() -= size;
+			size = 0;
+		}
+	}
+
+	bool empty() const {
+		return handle.IsEmpty();
+	}
+
+	// Access the value. Needs a HandleScope, normally from a JSObjectRef::Scope
+	JSObject get() const {
+		return JSObject(isolate, v8::Local<v8::Value>::New(isolate, handle));
+	}
+
+	// Enters the isolate and context of the value and opens a HandleScope for reading it
+	struct Scope : public JSCallScope {
+		Scope(const JSObjectRef &ref) : JSCallScope(ref.isolate, ref.context), ref(ref) {}
+		JSObject operator*() const { return ref.get(); }
+		const JSObjectRef &ref;
+	};
+
+	// Number of values currently kept alive by a JSObjectRef
+	static int count() {
+		return liveCount();
+	}
+
+	// Estimated JS heap bytes kept alive by all JSObjectRefs. Only the values
+	// themselves are counted, not the objects their properties point to.
+	static size_t bytes() {
+		return liveBytes();
+	}
+
+	// Estimated bytes kept alive by this reference
+	size_t byteSize() const {
+		return size;
+	}
+
+private:
+	static std::atomic<int> &liveCount() {
+		static std::atomic<int> count { 0 };
+		return count;
+	}
+
+	static std::atomic<size_t> &liveBytes() {
+		static std::atomic<size_t> bytes { 0 };
+		return bytes;
+	}
+
+	// The two handles, plus the characters of a string, the contents of a buffer
+	// or one slot per element or own property
+	static size_t shallowSize(const v8::Local<v8::Value> &v) {
+		using namespace v8;
+		size_t n = 2 * sizeof(void*);
+		if(v->IsString()) {
+			auto s = Local<String>::Cast(v);
+			n += s->Length() * (s->IsOneByte() ? 1 : 2);
+		} else if(v->IsArrayBufferView())
+			n += Local<ArrayBufferView>::Cast(v)->ByteLength();
+		else if(v->IsArrayBuffer())
+			n += Local<ArrayBuffer>::Cast(v)->ByteLength();
+		else if(v->IsArray())
+			n += Local<Array>::Cast(v)->Length() * sizeof(void*);
+		else if(v->IsObject())
+			n += Local<Object>::Cast(v)->GetOwnPropertyNames()->Length() * sizeof(void*);
+		return n;
+	}
+
+	v8::Isolate *isolate = nullptr;
+	v8::UniquePersistent<v8::Value> handle;
+	v8::UniquePersistent<v8::Context> context;
+	size_t size = 0;
+};
+
+struct JSObject::Entry {
+	JSKeyView key;
+	JSObject value;
+};
+
+// Iterates over keys and values together. Keys are not copied into strings,
+// and all handles go into the caller's HandleScope.
+class JSObject::entry_iterator {
+public:
+	entry_iterator(v8::Isolate *isolate, v8::Local<v8::Object> o, v8::Local<v8::Array> a, int pos = 0) : isolate(isolate), obj(o), names(a), position(pos) {}
+
+	bool operator!= (const entry_iterator& other) const {
+		return position != other.position;
+	}
+
+	Entry operator* () const {
+		auto key = names->Get(position);
+		return Entry{ JSKeyView(key), JSObject(isolate, obj->Get(key)) };
+	}
+
+	const entry_iterator& operator++ () {
+		position++;
+		return *this;
+	}
+private:
+	v8::Isolate *isolate;
+	v8::Local<v8::Object> obj;
+	v8::Local<v8::Array> names;
+	int position;
+};
+
+class JSObject::Entries {
+public:
+	entry_iterator b;
+	entry_iterator e;
+	entry_iterator begin() const { return b; }
+	entry_iterator end() const { return e; }
+};
+
+inline JSObject::Entries JSObject::entries() const {
+	getFields();
+	auto o = v8::Local<v8::Object>::Cast(lv);
+	return Entries{ entry_iterator(isolate, o, fields, 0), entry_iterator(isolate, o, fields, fields->Length()) };
+}
+
 // Add cast
 template <> struct JSValue<JSObject> {
 	static JSObject cast(const v8::Local<v8::Value> &v) {
@@ -126,4 +516,17 @@ template <> struct JSValue<JSObject> {
 	}
 };
 
+template <> struct JSValue<JSObjectRef> {
+	static JSObjectRef cast(const v8::Local<v8::Value> &v) {
+		return JSObjectRef(v8::Isolate::GetCurrent(), v);
+	}
+};
+
+template <> struct JSKeepsHandle<JSObject> : std::true_type {};
+
+// Any value can be taken as a JSObject
+template <> struct JSArgType<JSObject> {
+	static bool matches(const v8::Local<v8::Value> &v) { return true; }
+};
+
 #endif // V8_INTERPRETER_JSOBJECT_H
@@ -0,0 +1,311 @@
+// Measures the overhead of the bindings against the same work done directly with the
+// V8 API. Every case runs a precompiled JS loop and reports nanoseconds per iteration
+// for the binding and for the raw V8 baseline.
+//
+// Usage: v8bench [iterations]
+
+#include "v8interpreter.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+using namespace std;
+
+struct Inner {
+	int x = 0;
+};
+
+struct BenchObject {
+	int plain = 0;
+	Inner *pointer = nullptr;
+	Inner inner;
+	int offsetValue = 0;
+	int accessorValue = 0;
+
+	int getAccessor() { return accessorValue; }
+	void setAccessor(int v) { accessorValue = v; }
+};
+
+struct vec3 {
+	float x = 0;
+	float y = 0;
+	float z = 0;
+};
+
+// Raw V8 versions of the bound functions
+
+static void rawNop0(const v8::FunctionCallbackInfo<v8::Value> &info) {
+}
+
+static void rawNop1(const v8::FunctionCallbackInfo<v8::Value> &info) {
+	info.GetReturnValue().Set(info[0]->Int32Value());
+}
+
+static void rawNop4(const v8::FunctionCallbackInfo<v8::Value> &info) {
+	info.GetReturnValue().Set(info[0]->Int32Value() + info[1]->Int32Value() + info[2]->Int32Value() + info[3]->Int32Value());
+}
+
+static void rawEcho(const v8::FunctionCallbackInfo<v8::Value> &info) {
+	using namespace v8;
+	String::Utf8Value s(info[0]);
+	info.GetReturnValue().Set(String::NewFromUtf8(info.GetIsolate(), *s, String::kNormalString, s.length()));
+}
+
+static void rawGetVec(const v8::FunctionCallbackInfo<v8::Value> &info) {
+	using namespace v8;
+	auto *isolate = info.GetIsolate();
+	vec3 v;
+	auto obj = Object::New(isolate);
+	obj->Set(String::NewFromUtf8(isolate, "x"), Number::New(isolate, v.x));
+	obj->Set(String::NewFromUtf8(isolate, "y"), Number::New(isolate, v.y));
+	obj->Set(String::NewFromUtf8(isolate, "z"), Number::New(isolate, v.z));
+	info.GetReturnValue().Set(obj);
+}
+
+static void rawCallN(const v8::FunctionCallbackInfo<v8::Value> &info) {
+	using namespace v8;
+	auto *isolate = info.GetIsolate();
+	auto f = Local<Function>::Cast(info[0]);
+	int n = info[1]->Int32Value();
+	double sum = 0;
+	for(int i = 0; i < n; i++) {
+		Local<Value> arg = Number::New(isolate, i);
+		sum += f->Call(Undefined(isolate), 1, &arg)->NumberValue();
+	}
+	info.GetReturnValue().Set(sum);
+}
+
+// Raw accessors for each field kind of BenchObject
+
+static v8::Persistent<v8::ObjectTemplate> rawInnerTemplate;
+
+template <typename INFO> static BenchObject *rawThis(const INFO &info) {
+	return static_cast<BenchObject*>(info.This()->GetAlignedPointerFromInternalField(0));
+}
+
+static Inner *rawInnerOf(const v8::Local<v8::Value> &v) {
+	return static_cast<Inner*>(v8::Local<v8::Object>::Cast(v)->GetAlignedPointerFromInternalField(0));
+}
+
+// Pointer and inner object fields are returned as a new wrapper on every read
+static v8::Local<v8::Object> rawWrapInner(v8::Isolate *isolate, Inner *p) {
+	using namespace v8;
+	auto obj = Local<ObjectTemplate>::New(isolate, rawInnerTemplate)->NewInstance();
+	obj->SetAlignedPointerInInternalField(0, p);
+	return obj;
+}
+
+static void rawGetPlain(v8::Local<v8::String> name, const v8::PropertyCallbackInfo<v8::Value> &info) {
+	info.GetReturnValue().Set(rawThis(info)->plain);
+}
+
+static void rawSetPlain(v8::Local<v8::String> name, v8::Local<v8::Value> val, const v8::PropertyCallbackInfo<void> &info) {
+	rawThis(info)->plain = val->Int32Value();
+}
+
+static void rawGetPointer(v8::Local<v8::String> name, const v8::PropertyCallbackInfo<v8::Value> &info) {
+	info.GetReturnValue().Set(rawWrapInner(info.GetIsolate(), rawThis(info)->pointer));
+}
+
+static void rawSetPointer(v8::Local<v8::String> name, v8::Local<v8::Value> val, const v8::PropertyCallbackInfo<void> &info) {
+	rawThis(info)->pointer = rawInnerOf(val);
+}
+
+static void rawGetInner(v8::Local<v8::String> name, const v8::PropertyCallbackInfo<v8::Value> &info) {
+	info.GetReturnValue().Set(rawWrapInner(info.GetIsolate(), &rawThis(info)->inner));
+}
+
+static void rawSetInner(v8::Local<v8::String> name, v8::Local<v8::Value> val, const v8::PropertyCallbackInfo<void> &info) {
+	rawThis(info)->inner = *rawInnerOf(val);
+}
+
+static int &rawOffsetField(BenchObject *p) {
+	return *reinterpret_cast<int*>(reinterpret_cast<char*>(p) + offsetof(BenchObject, offsetValue));
+}
+
+static void rawGetOffset(v8::Local<v8::String> name, const v8::PropertyCallbackInfo<v8::Value> &info) {
+	info.GetReturnValue().Set(rawOffsetField(rawThis(info)));
+}
+
+static void rawSetOffset(v8::Local<v8::String> name, v8::Local<v8::Value> val, const v8::PropertyCallbackInfo<void> &info) {
+	rawOffsetField(rawThis(info)) = val->Int32Value();
+}
+
+static void rawGetAccessor(v8::Local<v8::String> name, const v8::PropertyCallbackInfo<v8::Value> &info) {
+	info.GetReturnValue().Set(rawThis(info)->getAccessor());
+}
+
+static void rawSetAccessor(v8::Local<v8::String> name, v8::Local<v8::Value> val, const v8::PropertyCallbackInfo<void> &info) {
+	rawThis(info)->setAccessor(val->Int32Value());
+}
+
+// A wrapper owning a C++ object, freed when the JS object is collected
+struct RawHolder {
+	v8::Persistent<v8::Object> handle;
+	unique_ptr<vec3> ptr;
+};
+
+static v8::Persistent<v8::ObjectTemplate> rawVecTemplate;
+
+static void rawFree(const v8::WeakCallbackInfo<RawHolder> &data) {
+	auto *holder = data.GetParameter();
+	holder->handle.Reset();
+	delete holder;
+}
+
+static void rawMakeVec(const v8::FunctionCallbackInfo<v8::Value> &info) {
+	using namespace v8;
+	auto *isolate = info.GetIsolate();
+	auto obj = Local<ObjectTemplate>::New(isolate, rawVecTemplate)->NewInstance();
+	auto *holder = new RawHolder();
+	holder->ptr.reset(new vec3());
+	obj->SetAlignedPointerInInternalField(0, holder->ptr.get());
+	holder->handle.Reset(isolate, obj);
+	holder->handle.SetWeak(holder, rawFree, WeakCallbackType::kParameter);
+	isolate->AdjustAmountOfExternalAllocatedMemory(sizeof(vec3));
+	info.GetReturnValue().Set(obj);
+}
+
+static void installRaw(V8Interpreter &v8) {
+	v8.callWithContext([&]() {
+		using namespace v8;
+		auto *isolate = Isolate::GetCurrent();
+		auto global = isolate->GetCurrentContext()->Global();
+		auto add = [&](const char *name, FunctionCallback cb) {
+			global->Set(String::NewFromUtf8(isolate, name), FunctionTemplate::New(isolate, cb)->GetFunction());
+		};
+		add("rawNop0", rawNop0);
+		add("rawNop1", rawNop1);
+		add("rawNop4", rawNop4);
+		add("rawEcho", rawEcho);
+		add("rawGetVec", rawGetVec);
+		add("rawCallN", rawCallN);
+		add("rawMakeVec", rawMakeVec);
+
+		auto it = ObjectTemplate::New(isolate);
+		it->SetInternalFieldCount(1);
+		rawInnerTemplate.Reset(isolate, it);
+
+		auto ot = ObjectTemplate::New(isolate);
+		ot->SetInternalFieldCount(1);
+		ot->SetAccessor(String::NewFromUtf8(isolate, "plain"), rawGetPlain, rawSetPlain);
+		ot->SetAccessor(String::NewFromUtf8(isolate, "pointer"), rawGetPointer, rawSetPointer);
+		ot->SetAccessor(String::NewFromUtf8(isolate, "inner"), rawGetInner, rawSetInner);
+		ot->SetAccessor(String::NewFromUtf8(isolate, "offset"), rawGetOffset, rawSetOffset);
+		ot->SetAccessor(String::NewFromUtf8(isolate, "accessor"), rawGetAccessor, rawSetAccessor);
+		auto obj = ot->NewInstance();
+		auto *bench = new BenchObject();
+		bench->pointer = new Inner();
+		obj->SetAlignedPointerInInternalField(0, bench);
+		global->Set(String::NewFromUtf8(isolate, "rawObj"), obj);
+
+		auto vt = ObjectTemplate::New(isolate);
+		vt->SetInternalFieldCount(1);
+		rawVecTemplate.Reset(isolate, vt);
+	});
+}
+
+static void installBindings(V8Interpreter &v8, BenchObject &obj) {
+	v8.registerFunction("nop0", []() {});
+	v8.registerFunction("nop1", [](int a) -> int { return a; });
+	v8.registerFunction("nop4", [](int a, int b, int c, int d) -> int { return a + b + c + d; });
+	v8.registerFunction("echo", [](string s) -> string { return s; });
+	v8.registerFunction("getVec", []() -> vec3 { return vec3(); });
+	v8.registerFunction("callN", [](std::function<double(double)> f, int n) -> double {
+		double sum = 0;
+		for(int i = 0; i < n; i++)
+			sum += f(i);
+		return sum;
+	});
+	v8.registerFunction("makeVec", []() -> shared_ptr<vec3> { return make_shared<vec3>(); });
+
+	v8.registerClass<vec3>()
+		.field("x", &vec3::x)
+		.field("y", &vec3::y)
+		.field("z", &vec3::z);
+	v8.registerClass<Inner>()
+		.field("x", &Inner::x);
+	v8.registerClass<BenchObject>()
+		.field("plain", &BenchObject::plain)
+		.field("pointer", &BenchObject::pointer)
+		.field("inner", &BenchObject::inner)
+		.field<int>("offset", offsetof(BenchObject, offsetValue))
+		.field("accessor", &BenchObject::getAccessor, &BenchObject::setAccessor);
+
+	obj.pointer = new Inner();
+	v8.callWithContext([&]() {
+		v8.addGlobalObject("obj", &obj);
+	});
+}
+
+using Clock = std::chrono::steady_clock;
+
+// Nanoseconds per iteration of `body`, run `n` times in a precompiled loop.
+// `after` is run inside the timed region, and `ops` is the work per iteration.
+static double measure(V8Interpreter &v8, const string &body, int n, int ops = 1, std::function<void()> after = nullptr) {
+	auto script = v8.compile("for(var i = 0; i < " + to_string(n) + "; i++) { " + body + " }", "bench");
+	script.run();
+	if(after)
+		v8.callWithContext(after);
+	auto t0 = Clock::now();
+	script.run();
+	if(after)
+		v8.callWithContext(after);
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+	return (double)ns / ((double)n * ops);
+}
+
+static void report(const string &name, double binding, double raw) {
+	printf("%-26s %10.1f %10.1f %8.2fx\n", name.c_str(), binding, raw, raw > 0 ? binding / raw : 0.0);
+}
+
+int main(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+
+	V8Interpreter v8;
+	BenchObject obj;
+	installBindings(v8, obj);
+	installRaw(v8);
+
+	v8.exec("var x; var s16 = new Array(17).join('a'); var s1k = new Array(1025).join('a'); var s100k = new Array(102401).join('a');");
+	v8.exec("function inc(v) { return v + 1; }");
+
+	printf("%-26s %10s %10s %9s\n", "case", "binding ns", "raw ns", "overhead");
+
+	report("call 0 args", measure(v8, "nop0();", n), measure(v8, "rawNop0();", n));
+	report("call 1 arg", measure(v8, "nop1(i);", n), measure(v8, "rawNop1(i);", n));
+	report("call 4 args", measure(v8, "nop4(i, 1, 2, 3);", n), measure(v8, "rawNop4(i, 1, 2, 3);", n));
+
+	// Each field kind is compared with a raw accessor doing the same work. Object
+	// valued fields are set from a wrapper read once up front, not from whatever an
+	// earlier case left behind.
+	v8.exec("var inner = obj.inner; var rawInner = rawObj.inner;");
+	report("get FieldRef", measure(v8, "x = obj.plain;", n), measure(v8, "x = rawObj.plain;", n));
+	report("set FieldRef", measure(v8, "obj.plain = i;", n), measure(v8, "rawObj.plain = i;", n));
+	report("get FieldRef<T*>", measure(v8, "x = obj.pointer;", n), measure(v8, "x = rawObj.pointer;", n));
+	report("set FieldRef<T*>", measure(v8, "obj.pointer = inner;", n), measure(v8, "rawObj.pointer = rawInner;", n));
+	report("get FieldPtrRef", measure(v8, "x = obj.inner;", n), measure(v8, "x = rawObj.inner;", n));
+	report("set FieldPtrRef", measure(v8, "obj.inner = inner;", n), measure(v8, "rawObj.inner = rawInner;", n));
+	report("get OffsetRef", measure(v8, "x = obj.offset;", n), measure(v8, "x = rawObj.offset;", n));
+	report("set OffsetRef", measure(v8, "obj.offset = i;", n), measure(v8, "rawObj.offset = i;", n));
+	report("get AccessorRef", measure(v8, "x = obj.accessor;", n), measure(v8, "x = rawObj.accessor;", n));
+	report("set AccessorRef", measure(v8, "obj.accessor = i;", n), measure(v8, "rawObj.accessor = i;", n));
+
+	report("string 16 B", measure(v8, "x = echo(s16);", n), measure(v8, "x = rawEcho(s16);", n));
+	report("string 1 KB", measure(v8, "x = echo(s1k);", n / 10), measure(v8, "x = rawEcho(s1k);", n / 10));
+	report("string 100 KB", measure(v8, "x = echo(s100k);", n / 1000), measure(v8, "x = rawEcho(s100k);", n / 1000));
+
+	report("struct return", measure(v8, "x = getVec();", n), measure(v8, "x = rawGetVec();", n));
+
+	report("std::function callback", measure(v8, "x = callN(inc, 100);", n / 100, 100), measure(v8, "x = rawCallN(inc, 100);", n / 100, 100));
+
+	// Includes collecting the wrappers, so finalization is part of the cost
+	auto collect = []() { v8::Isolate::GetCurrent()->LowMemoryNotification(); };
+	report("wrapper GC churn", measure(v8, "makeVec();", n / 10, 1, collect), measure(v8, "rawMakeVec();", n / 10, 1, collect));
+
+	return 0;
+}
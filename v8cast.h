@@ -2,11 +2,19 @@
 #define V8INTERPRETER_CAST_H
 
 #include "v8.h"
+#include "jskey.h"
+#include "conversionstats.h"
 #define TYPE(x) demangle(typeid(x).name())
 
 #include <unordered_map>
+#include <algorithm>
 #include <memory>
 #include <string>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
 
 #ifdef USE_APONE
 #include <coreutils/log.h>
@@ -22,16 +30,182 @@ template <typename T> using ptr = std::shared_ptr<T>;
 
 /// ****************************** TYPE CONVERSION UTILS ***********************************
 
+// How objects of a registered class are passed by value between C++ and JS
+enum class ValueMode {
+	Reference,    // JS wrapper object pointing to a C++ copy (default)
+	PlainObject,  // Plain JS object with one data property per field
+	Float32Array, // Packed Float32Array with one element per field
+	Float64Array  // Packed Float64Array with one element per field
+};
+
+// Numeric access to a field of a value mode class
+template <typename CLASS> struct ValueFieldBase {
+	virtual double get(CLASS *p) = 0;
+	virtual void set(CLASS *p, double v) = 0;
+};
+
+// The typed array type holding elements of an arithmetic C++ type
+template <typename T> struct JSTypedArray {
+	static const bool defined = false;
+};
+
+#define JS_TYPED_ARRAY(T, ARRAY) \
+template <> struct JSTypedArray<T> { \
+	static const bool defined = true; \
+	static const char *name() { return #ARRAY; } \
+	static bool is(const v8::Local<v8::Value> &v) { return v->Is##ARRAY(); } \
+	static v8::Local<v8::TypedArray> New(v8::Isolate *isolate, size_t n) { \
+		return v8::ARRAY::New(v8::ArrayBuffer::New(isolate, n * sizeof(T)), 0, n); \
+	} \
+	/* View of C++ memory, which must outlive the array or be neutered first */ \
+	static v8::Local<v8::TypedArray> wrap(v8::Isolate *isolate, T *data, size_t n) { \
+		return v8::ARRAY::New(v8::ArrayBuffer::New(isolate, data, n * sizeof(T)), 0, n); \
+	} \
+	static T *data(const v8::Local<v8::TypedArray> &ta) { \
+		auto contents = ta->Buffer()->GetContents(); \
+		return reinterpret_cast<T*>(static_cast<uint8_t*>(contents.Data()) + ta->ByteOffset()); \
+	} \
+};
+
+JS_TYPED_ARRAY(float, Float32Array)
+JS_TYPED_ARRAY(double, Float64Array)
+JS_TYPED_ARRAY(int8_t, Int8Array)
+JS_TYPED_ARRAY(uint8_t, Uint8Array)
+JS_TYPED_ARRAY(int16_t, Int16Array)
+JS_TYPED_ARRAY(uint16_t, Uint16Array)
+JS_TYPED_ARRAY(int32_t, Int32Array)
+JS_TYPED_ARRAY(uint32_t, Uint32Array)
+
+#undef JS_TYPED_ARRAY
+
 template <typename CLASS> struct JSClass {
 
 	
 	using Template = v8::UniquePersistent<v8::ObjectTemplate>;
 
+	struct ValueInfo {
+		ValueMode mode = ValueMode::Reference;
+		std::vector<std::pair<std::string, ValueFieldBase<CLASS>*>> fields;
+		std::vector<v8::Eternal<v8::String>> keys;
+		// All plain objects are created from this template so they share one hidden class
+		v8::UniquePersistent<v8::ObjectTemplate> templ;
+	};
+
+	static ValueInfo& valueInfo() {
+		static ValueInfo vi;
+		return vi;
+	}
+
+	static ValueMode valueMode() {
+		return valueInfo().mode;
+	}
+
+	static void addValueField(const std::string &name, ValueFieldBase<CLASS> *vf) {
+		auto &vi = valueInfo();
+		vi.fields.emplace_back(name, vf);
+		// Fields added after the value mode was set need keys and a new template
+		if(vi.mode != ValueMode::Reference)
+			setValueMode(isolateRef(), vi.mode);
+	}
+
+	// Switch the class to a value mode, using the fields added so far
+	static void setValueMode(v8::Isolate *isolate, ValueMode mode) {
+		using namespace v8;
+		HandleScope hs(isolate);
+		auto &vi = valueInfo();
+		vi.mode = mode;
+		vi.keys.clear();
+		auto ot = ObjectTemplate::New(isolate);
+		for(auto &f : vi.fields) {
+			auto key = intern_key(isolate, f.first);
+			vi.keys.emplace_back(isolate, key);
+			ot->Set(key, Number::New(isolate, 0));
+		}
+		vi.templ.Reset(isolate, ot);
+	}
+
+	// Convert to a plain object or typed array according to the value mode
+	static v8::Local<v8::Value> toValue(v8::Isolate *isolate, const CLASS &t) {
+		using namespace v8;
+		auto &vi = valueInfo();
+		auto *p = const_cast<CLASS*>(&t);
+		auto n = vi.fields.size();
+		switch(vi.mode) {
+		case ValueMode::Float32Array:
+			return Float32Array::New(toBuffer<float>(isolate, p), 0, n);
+		case ValueMode::Float64Array:
+			return Float64Array::New(toBuffer<double>(isolate, p), 0, n);
+		default:
+			break;
+		}
+		auto obj = Local<ObjectTemplate>::New(isolate, vi.templ)->NewInstance();
+		for(size_t i=0; i<n; i++)
+			obj->Set(vi.keys[i].Get(isolate), Number::New(isolate, vi.fields[i].second->get(p)));
+		return obj;
+	}
+
+	// Read back a plain object or typed array. Returns false if `v` is neither
+	static bool fromValue(const v8::Local<v8::Value> &v, CLASS &t) {
+		using namespace v8;
+		auto &vi = valueInfo();
+		auto n = vi.fields.size();
+		if(v->IsFloat32Array())
+			return fromBuffer<float>(Local<TypedArray>::Cast(v), t);
+		if(v->IsFloat64Array())
+			return fromBuffer<double>(Local<TypedArray>::Cast(v), t);
+		if(!v->IsObject() || v->IsArrayBufferView())
+			return false;
+		auto obj = Local<Object>::Cast(v);
+		if(obj->InternalFieldCount() > 0)
+			return false;
+		auto *isolate = Isolate::GetCurrent();
+		for(size_t i=0; i<n; i++) {
+			Local<Value> val = obj->Get(vi.keys[i].Get(isolate));
+			if(val->IsNumber())
+				vi.fields[i].second->set(&t, Number::Cast(*val)->Value());
+			else if(!val->IsUndefined())
+				vi.fields[i].second->set(&t, val->NumberValue());
+		}
+		return true;
+	}
+
+	template <typename E> static v8::Local<v8::ArrayBuffer> toBuffer(v8::Isolate *isolate, CLASS *p) {
+		auto &fields = valueInfo().fields;
+		auto buf = v8::ArrayBuffer::New(isolate, fields.size() * sizeof(E));
+		auto *data = static_cast<E*>(buf->GetContents().Data());
+		for(size_t i=0; i<fields.size(); i++)
+			data[i] = static_cast<E>(fields[i].second->get(p));
+		return buf;
+	}
+
+	template <typename E> static bool fromBuffer(const v8::Local<v8::TypedArray> &ta, CLASS &t) {
+		auto &fields = valueInfo().fields;
+		auto *data = JSTypedArray<E>::data(ta);
+		size_t n = std::min(fields.size(), ta->Length());
+		for(size_t i=0; i<n; i++)
+			fields[i].second->set(&t, data[i]);
+		return true;
+	}
+
 	static Template*& get() {
 		static Template *ptr;
 		return ptr;
 	}
 
+	// Unique per class. Stored in the second internal field of every wrapper so
+	// the class of a JS object can be checked without converting it.
+	static void *typeTag() {
+		static int tag;
+		return &tag;
+	}
+
+	static const int InternalFieldCount = 2;
+
+	static void wrap(v8::Local<v8::Object> obj, CLASS *ptr) {
+		obj->SetAlignedPointerInInternalField(0, ptr);
+		obj->SetAlignedPointerInInternalField(1, typeTag());
+	}
+
 	static v8::Isolate*& isolateRef() {
 		static v8::Isolate *i;
 		return i;
@@ -41,7 +215,7 @@ template <typename CLASS> struct JSClass {
 	static void regClass(v8::Isolate *isolate) {
 
 		auto ot = v8::ObjectTemplate::New(isolate);
-		ot->SetInternalFieldCount(1);
+		ot->SetInternalFieldCount(InternalFieldCount);
 		auto *otempl = new Template(isolate, ot);
 		get() = otempl;
 		isolateRef() = isolate;
@@ -55,7 +229,8 @@ template <typename CLASS> struct JSClass {
 			throw v8_exception(std::string("Can not create unregistered class `") + TYPE(CLASS) + "`");
 		auto ot = Local<ObjectTemplate>::New(isolateRef(), *otempl);
 		Local<Object> obj = ot->NewInstance();
-		obj->SetAlignedPointerInInternalField(0, ptr);
+		wrap(obj, ptr);
+		CONVERSION_STAT(CLASS, wrappers, 1);
 		return obj;
 	}
 };
@@ -68,6 +243,70 @@ template <typename CLASS> v8::Local<v8::Object> createproxy(v8::Isolate *isolate
 	return JSClass<CLASS>::createInstance(ptr);
 }
 
+// Classes wrapped by ObjectHolder, with the number of JS wrappers currently owning
+// an object of each. The class id labels the wrapper handles in heap snapshots.
+class WrapperStats {
+public:
+	struct Class {
+		Class(uint16_t id, const std::string &name, size_t size) : id(id), name(name), size(size) {}
+		uint16_t id;
+		std::string name;
+		size_t size;
+		std::atomic<int> alive { 0 };
+	};
+
+	template <typename T> static Class &of() {
+		static Class *c = add(TYPE(T), sizeof(T));
+		return *c;
+	}
+
+	template <typename T> static std::atomic<int> &alive() {
+		return of<T>().alive;
+	}
+
+	static std::vector<std::pair<std::string, int>> counts() {
+		std::lock_guard<std::mutex> guard(registry().m);
+		std::vector<std::pair<std::string, int>> result;
+		for(auto *c : registry().classes)
+			result.emplace_back(c->name, c->alive.load());
+		return result;
+	}
+
+	static std::vector<uint16_t> classIds() {
+		std::lock_guard<std::mutex> guard(registry().m);
+		std::vector<uint16_t> result;
+		for(auto *c : registry().classes)
+			result.push_back(c->id);
+		return result;
+	}
+
+	static Class *byId(uint16_t id) {
+		std::lock_guard<std::mutex> guard(registry().m);
+		auto &classes = registry().classes;
+		return id > 0 && id <= classes.size() ? classes[id - 1] : nullptr;
+	}
+
+private:
+	struct Registry {
+		std::mutex m;
+		std::vector<Class*> classes;
+	};
+
+	static Registry &registry() {
+		static Registry r;
+		return r;
+	}
+
+	// Class ids start at 1, since 0 means no class id
+	static Class *add(const std::string &name, size_t size) {
+		std::lock_guard<std::mutex> guard(registry().m);
+		auto &classes = registry().classes;
+		auto *c = new Class(classes.size() + 1, name, size);
+		classes.push_back(c);
+		return c;
+	}
+};
+
 // Give ownership of C++ object to V8
 // Accomplished by creating an ObjectHolder for each reference, and using a static map between
 // pointers and the holder.
@@ -87,19 +326,22 @@ private:
 			LOGW("Warning: Casting to unregistered class `%s`", TYPE(T));
 			// Create an empty object template
 			ot = ObjectTemplate::New(isolate);
-			ot->SetInternalFieldCount(1);
+			ot->SetInternalFieldCount(JSClass<T>::InternalFieldCount);
 		}
 
 		// Create a JS object with a pointer to the C++ object
 		auto o = ot->NewInstance();
-		o->SetAlignedPointerInInternalField(0, ptr);
+		JSClass<T>::wrap(o, ptr);
 
 		// Create a 'holder' that keeps the shared_ptr alive by keeping a weak reference
 		// to the created object. I will be notified when it is the last referencer of the
 		// object, at which point it can also release the shared_ptr
 		holder.Reset(isolate, o);
+		CONVERSION_STAT(T, wrappers, 1);
 		holder.SetWeak(this, callback, v8::WeakCallbackType::kParameter);
 		holder.MarkIndependent();
+		holder.SetWrapperClassId(WrapperStats::of<T>().id);
+		WrapperStats::alive<T>()++;
 		isolate->AdjustAmountOfExternalAllocatedMemory(sizeof(T));
 		LOGD("Created Instance of %s = %p", TYPE(T), ptr);
 	}
@@ -113,13 +355,14 @@ private:
 		} else {
 			LOGW("Warning: Casting to unregistered class `%s`", TYPE(T));
 			ot = ObjectTemplate::New(isolate);
-			ot->SetInternalFieldCount(1);
+			ot->SetInternalFieldCount(JSClass<T>::InternalFieldCount);
 		}
 
 		auto o = ot->NewInstance();
-		o->SetAlignedPointerInInternalField(0, ptr);
+		JSClass<T>::wrap(o, ptr);
 
 		holder.Reset(isolate, o);
+		CONVERSION_STAT(T, wrappers, 1);
 	
 	}
 public:	
@@ -127,6 +370,7 @@ public:
 	static void callback(const v8::WeakCallbackInfo<ObjectHolder<T>>& data) {
 		ObjectHolder<T> *param = data.GetParameter();
 		LOGD("Instance of %s = %p freed", TYPE(T), param->sptr.get());
+		WrapperStats::alive<T>()--;
         param->holder.Reset();
         objects()[param->sptr.get()] = nullptr;
         //delete param;
@@ -137,6 +381,7 @@ public:
         auto oh = ObjectHolder<T>::objects()[sp.get()];
         if(!oh) {
 			oh = std::shared_ptr<ObjectHolder>(new ObjectHolder(isolate, sp));
+			CONVERSION_STAT(T, allocations, 1);
             ObjectHolder::objects()[sp.get()] = oh;
         }
 		return v8::Local<v8::Value>::New(isolate, oh->holder);	
@@ -170,19 +415,29 @@ private:
 template <typename T> struct JSValue {
 	static T cast(const v8::Local<v8::Value> &v) {
 		using namespace v8;
+
+		// Value mode classes are read directly from plain objects or typed arrays
+		if(JSClass<T>::valueMode() != ValueMode::Reference) {
+			T result;
+			if(JSClass<T>::fromValue(v, result)) {
+				CONVERSION_STAT(T, bytes, sizeof(T));
+				return result;
+			}
+		}
+
 		auto obj = v8::Local<v8::Object>::Cast(v);
 		
 		// If object was created on the native side, it will contain a pointer
 		if(obj->InternalFieldCount() > 0) {
 			T *t = static_cast<T*>(obj->GetAlignedPointerFromInternalField(0));
+			CONVERSION_STAT(T, bytes, sizeof(T));
 			return *t;
 		}
 
 		// Otherwise create a default T object, and utilize existing setters to set
 		// fields from the javascript object. 
 		T result;
-		v8::Isolate *isolate = JSClass<T>::get_isolate();
-		auto dst = JSClass<T>::createInstance(isolate, &result);
+		auto dst = JSClass<T>::createInstance(&result);
 		Local<Object> src = Local<Object>::Cast(v);
 		Local<Array> parray = src->GetPropertyNames();
 		for(int i=0; i<parray->Length(); i++) {
@@ -192,29 +447,21 @@ template <typename T> struct JSValue {
 			dst->Set(key, val);
 		}
 
+		CONVERSION_STAT(T, bytes, sizeof(T));
 		return result;
 	}
 };
 
-// Cast Javascript function to std::function
-template <typename ... ARGS> struct JSValue<std::function<void(ARGS...)>> {
-	static std::function<void(ARGS...)> cast(const v8::Local<v8::Value> &v) {
-		using namespace v8;
-		auto lf = Local<Function>::Cast(v);
-		auto *isolate = v8::Isolate::GetCurrent();
-		auto pf = std::make_shared<UniquePersistent<Function>>(isolate, lf);
-		// We create a lambda that calls the provided JS function and return it
-		return [=](ARGS... args) {
-			Isolate::Scope isolate_scope(isolate);
-			HandleScope hs(isolate);
-			auto recv = Null(isolate);
-			Local<Value> arg_array[] = { to_js(isolate, args)... };
-			auto f = Local<Function>::New(isolate, *pf);
-			f->Call(recv, sizeof...(args), arg_array);
-		};
-	}
+// Discard a result
+template <> struct JSValue<void> {
+	static void cast(const v8::Local<v8::Value> &v) {}
 };
 
+template <> struct JSValue<bool> {
+	static bool cast(const v8::Local<v8::Value> &v) {
+		return v->BooleanValue();
+	}
+};
 
 template <> struct JSValue<double> {
 	static double cast(const v8::Local<v8::Value> &v) {
@@ -244,7 +491,8 @@ template <typename T> struct JSValue<T*> {
 	static T* cast(const v8::Local<v8::Value> &v) {
 		T *t = nullptr;
 		auto obj = v8::Local<v8::Object>::Cast(v);
-		if(obj->InternalFieldCount() > 0) {
+		bool byValue = JSClass<T>::valueMode() != ValueMode::Reference && (v->IsArrayBufferView() || obj->InternalFieldCount() == 0);
+		if(!byValue && obj->InternalFieldCount() > 0) {
 			t = static_cast<T*>(obj->GetAlignedPointerFromInternalField(0));
 		}
 
@@ -252,6 +500,7 @@ template <typename T> struct JSValue<T*> {
         if(!t) {
             LOGW(">>> Leaking a %s. Must be fixed!", TYPE(T));
             t = new T(JSValue<T>::cast(v));
+            CONVERSION_STAT(T, allocations, 1);
         }
 		return t;
 	}
@@ -266,20 +515,65 @@ template <typename T> struct JSValue<std::shared_ptr<T>> {
 			if(oh)
 				return oh->sptr;
 		}
+		CONVERSION_STAT(T, allocations, 1);
 		return std::make_shared<T>(JSValue<T>::cast(v));
 	}
 };
 
 template <> struct JSValue<std::string> {
 	static std::string cast(const v8::Local<v8::Value> &v) {
-		char target[1024];
-		v->ToString()->WriteUtf8(target, sizeof(target));
-		return std::string(target);
+		v8::String::Utf8Value utf8(v);
+		if(!*utf8)
+			return "";
+		CONVERSION_STAT(std::string, bytes, utf8.length());
+		CONVERSION_STAT(std::string, allocations, 1);
+		return std::string(*utf8, utf8.length());
+	}
+};
+
+// Cheap type tests on JS values, used to select between overloaded functions
+// without trying any conversions
+template <typename T, typename = void> struct JSArgType {
+	static bool matches(const v8::Local<v8::Value> &v) {
+		if(!v->IsObject())
+			return false;
+		// Typed arrays and anonymous objects can be converted to value mode classes
+		if(v->IsArrayBufferView())
+			return JSClass<T>::valueMode() != ValueMode::Reference;
+		auto obj = v8::Local<v8::Object>::Cast(v);
+		if(obj->InternalFieldCount() < JSClass<T>::InternalFieldCount)
+			return obj->InternalFieldCount() == 0;
+		return obj->GetAlignedPointerFromInternalField(1) == JSClass<T>::typeTag();
 	}
 };
 
+template <typename T> struct JSArgType<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+	static bool matches(const v8::Local<v8::Value> &v) { return v->IsNumber(); }
+};
+
+template <> struct JSArgType<bool> {
+	static bool matches(const v8::Local<v8::Value> &v) { return v->IsBoolean(); }
+};
+
+template <> struct JSArgType<std::string> {
+	static bool matches(const v8::Local<v8::Value> &v) { return v->IsString(); }
+};
+
+template <typename F> struct JSArgType<std::function<F>> {
+	static bool matches(const v8::Local<v8::Value> &v) { return v->IsFunction(); }
+};
+
+template <typename T> struct JSArgType<T*> {
+	static bool matches(const v8::Local<v8::Value> &v) { return v->IsNull() || JSArgType<T>::matches(v); }
+};
+
+template <typename T> struct JSArgType<std::shared_ptr<T>> {
+	static bool matches(const v8::Local<v8::Value> &v) { return v->IsNull() || JSArgType<T>::matches(v); }
+};
+
 //// The wrapper function for the class templates
 template <typename T> T to_cpp(const v8::Local<v8::Value> &v) {
+	CONVERSION_STAT(T, toCpp, 1);
 	return JSValue<T>::cast(v);
 }
 
@@ -294,6 +588,10 @@ template <typename T, typename V = v8::Value> struct CPPValue {
 	static v8::Local<V> cast(v8::Isolate *isolate, const T &t) {
 		using namespace v8;
 		//LOGW("Creating copy of %s", TYPE(T));	
+		if(JSClass<T>::valueMode() != ValueMode::Reference)
+			return JSClass<T>::toValue(isolate, t);
+		CONVERSION_STAT(T, bytes, sizeof(T));
+		CONVERSION_STAT(T, allocations, 1);
 		return ObjectHolder<T>::get(isolate, std::make_shared<T>(t));
 	}
 };
@@ -304,6 +602,9 @@ template <typename T, typename V> struct CPPValue<T*, V> {
 		using namespace v8;
 		if(!t)
 			return v8::Null(isolate);
+		// Value mode classes have no reference semantics, fields of that type are copied
+		if(JSClass<T>::valueMode() != ValueMode::Reference)
+			return JSClass<T>::toValue(isolate, *t);
 		// TODO: Option to disallow raw pointers that does not map to a previous shared_ptr
 	//	LOGW("Using raw ptr of %s", TYPE(T));	
 		return ObjectHolder<T>::get(isolate, t);
@@ -320,21 +621,25 @@ template <typename T, typename V> struct CPPValue<std::shared_ptr<T>, V> {
 
 template <typename V> struct CPPValue<std::string*, V> {
 	static v8::Local<V> cast(v8::Isolate *isolate, const std::string *t) {
+		CONVERSION_STAT(std::string, bytes, t->size());
 		return v8::String::NewFromUtf8(isolate, t->c_str());
 	}
 };
 
 template <typename V> struct CPPValue<std::string, V> {
 	static v8::Local<V> cast(v8::Isolate *isolate, const std::string &t) {
+		CONVERSION_STAT(std::string, bytes, t.size());
 		return v8::String::NewFromUtf8(isolate, t.c_str());
 	}
 };
 
 template<typename T, typename V = v8::Value> static is_arithmetic<T, v8::Local<V>> to_js(v8::Isolate *isolate, const T &t) {
+	CONVERSION_STAT(T, toJs, 1);
 	return v8::Number::New(isolate, t);
 }
 
 template<typename T, typename V = v8::Value> static is_not_arithmetic<T, v8::Local<V>> to_js(v8::Isolate *isolate, const T &t) {
+	CONVERSION_STAT(T, toJs, 1);
 	return CPPValue<T,V>::cast(isolate, t);
 }
 
@@ -343,5 +648,8 @@ template<typename T, typename V = v8::Value> static is_not_arithmetic<T, v8::Loc
 #undef LOGD
 #endif
 
+// Conversions to JSFunction and std::function
+#include "jsfunction.h"
+
 #endif // V8INTERPRETER_CAST_H
 
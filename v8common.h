@@ -3,10 +3,25 @@
 
 #include <v8.h>
 #include <v8-platform.h>
+#include <atomic>
 #include <string>
+#include <type_traits>
 #include <typeinfo>
+
+#include "watchdog.h"
+
+// Isolate::AddNearHeapLimitCallback appeared in V8 6.6
+#define V8_NEAR_HEAP_LIMIT_CALLBACK (V8_MAJOR_VERSION > 6 || (V8_MAJOR_VERSION == 6 && V8_MINOR_VERSION >= 6))
+
 std::string demangle(const char* name);
 
+// Isolate data slots used by the interpreter
+enum IsolateSlot {
+	KeyCacheSlot = 0,
+	InterpreterSlot = 1,
+	ScriptStateSlot = 2
+};
+
 class v8_exception : public std::exception {
 public:
 	v8_exception(const std::string &msg = "") : msg(msg) {}
@@ -15,4 +30,153 @@ private:
 	std::string msg;
 };
 
+// Thrown when a script is terminated for getting close to the heap limit
+class v8_heap_limit : public v8_exception {
+public:
+	v8_heap_limit(const std::string &msg = "") : v8_exception(msg) {}
+};
+
+// Thrown when a script is terminated for running past its deadline or CPU budget
+class v8_timeout : public v8_exception {
+public:
+	v8_timeout(const std::string &msg = "") : v8_exception(msg) {}
+};
+
+// Enters an isolate unless it is already the current one
+struct IsolateEntry {
+	IsolateEntry(v8::Isolate *isolate) : isolate(isolate), entered(v8::Isolate::GetCurrent() != isolate) {
+		if(entered)
+			isolate->Enter();
+	}
+	~IsolateEntry() {
+		if(entered)
+			isolate->Exit();
+	}
+	v8::Isolate *isolate;
+	bool entered;
+};
+
+// Enters a context unless it is already the current one. Needs a HandleScope.
+struct ContextEntry {
+	template <typename P> ContextEntry(v8::Isolate *isolate, const P &context) : ctx(v8::Local<v8::Context>::New(isolate, context)) {
+		entered = !isolate->InContext() || isolate->GetCurrentContext() != ctx;
+		if(entered)
+			ctx->Enter();
+	}
+	~ContextEntry() {
+		if(entered)
+			ctx->Exit();
+	}
+	v8::Local<v8::Context> ctx;
+	bool entered;
+};
+
+// Everything needed to call into JS from C++, entering only what is not already entered
+struct JSCallScope {
+	template <typename P> JSCallScope(v8::Isolate *isolate, const P &context) : ie(isolate), hs(isolate), ce(isolate, context) {}
+	// Results are converted to C++ before the scope closes, so nothing needs to escape
+	template <typename T> v8::Local<T> result(const v8::Local<T> &v) { return v; }
+	IsolateEntry ie;
+	v8::HandleScope hs;
+	ContextEntry ce;
+};
+
+// Like JSCallScope, but the result is moved to the caller's HandleScope. Used when
+// the C++ result still holds a handle. Needs a HandleScope to be open already.
+struct JSEscapeScope {
+	template <typename P> JSEscapeScope(v8::Isolate *isolate, const P &context) : ie(isolate), hs(isolate), ce(isolate, context) {}
+	template <typename T> v8::Local<T> result(const v8::Local<T> &v) { return hs.Escape(v); }
+	IsolateEntry ie;
+	v8::EscapableHandleScope hs;
+	ContextEntry ce;
+};
+
+// True for C++ result types that keep a Local to the JS value, like JSObject
+template <typename T> struct JSKeepsHandle : std::false_type {};
+
+// The scope to call JS in when the result is converted to T
+template <typename T> using JSResultScope = typename std::conditional<JSKeepsHandle<T>::value, JSEscapeScope, JSCallScope>::type;
+
+// Per isolate state shared by every path that runs JS
+struct ScriptState {
+	// Nesting depth of JS calls from C++, 0 when no script is running
+	int depth = 0;
+	// Set when the heap limit handling has terminated the running script
+	std::atomic<bool> heapTerminated { false };
+	// Set when a deadline or the CPU budget has terminated the running script
+	Watchdog::Reason timedOut = Watchdog::None;
+	// CPU seconds all scripts may use, 0 for no limit, and the seconds used so far
+	double cpuBudget = 0;
+	double cpuUsed = 0;
+
+	static ScriptState *of(v8::Isolate *isolate) {
+		return static_cast<ScriptState*>(isolate->GetData(ScriptStateSlot));
+	}
+};
+
+// Marks JS as running while in scope. Isolates without a ScriptState are not tracked.
+// The outermost entry charges the CPU budget, and `timeout` in seconds puts a
+// deadline on this call.
+struct ScriptEntry {
+	ScriptEntry(v8::Isolate *isolate, double timeout = 0) : isolate(isolate), state(ScriptState::of(isolate)), watch(isolate, timeout, budgetLeft(state)) {
+		if(state)
+			state->depth++;
+	}
+	~ScriptEntry() {
+		if(state) {
+			if(state->depth == 1)
+				state->cpuUsed += watch.cpuSeconds();
+			state->depth--;
+		}
+	}
+	ScriptEntry(const ScriptEntry&) = delete;
+	ScriptEntry &operator=(const ScriptEntry&) = delete;
+
+	// True if JS was already running, as when called from a native callback
+	bool nested() const {
+		return state && state->depth > 1;
+	}
+
+	// Call when the JS call has returned. The outermost entry cancels a termination by
+	// the heap limit handling or the watchdog, so it does not hit the next script, and
+	// reports it. Nested entries leave it to unwind the calling script.
+	void check() {
+		// The watchdog may fire just as the script finishes, so stop it first
+		watch.stop();
+		if(!state)
+			return;
+		if(watch.fired() != Watchdog::None && state->timedOut == Watchdog::None)
+			state->timedOut = watch.fired();
+		if(state->depth != 1)
+			return;
+		if(state->heapTerminated) {
+			state->heapTerminated = false;
+			state->timedOut = Watchdog::None;
+			isolate->CancelTerminateExecution();
+			throw v8_heap_limit("Heap limit reached");
+		}
+		if(state->timedOut != Watchdog::None) {
+			auto reason = state->timedOut;
+			state->timedOut = Watchdog::None;
+			isolate->CancelTerminateExecution();
+			throw v8_timeout(reason == Watchdog::Deadline ? "Script timed out" : "CPU budget used up");
+		}
+	}
+
+	v8::Isolate *isolate;
+	ScriptState *state;
+	Watchdog::Scope watch;
+
+private:
+	// CPU seconds the outermost entry may use. Throws if the budget is used up, before
+	// any JS runs.
+	static double budgetLeft(ScriptState *state) {
+		if(!state || state->depth > 0 || state->cpuBudget <= 0)
+			return 0;
+		if(state->cpuUsed >= state->cpuBudget)
+			throw v8_timeout("CPU budget used up");
+		return state->cpuBudget - state->cpuUsed;
+	}
+};
+
 #endif // V8INTERPRETER_V8_H
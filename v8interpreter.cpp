@@ -1,7 +1,15 @@
 #include "v8interpreter.h"
+#include <v8-profiler.h>
 #include <thread>
+#include <cctype>
 #include <stdexcept>
+#include <fstream>
+#include <sstream>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #ifdef USE_REPL
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -39,19 +47,80 @@ std::string demangle(const char* name) {
 #endif
 
 
-std::string readFile(const std::string &name) {
-	FILE *fp = fopen(name.c_str(), "rb");
-	if(!fp)
-		throw std::exception();
-	fseek(fp, 0, SEEK_END);
-	uint32_t size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	char data[size];
-	fread(data, 1, size, fp);
-	fclose(fp);
+// Read only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile(const std::string &name) {
+		int fd = open(name.c_str(), O_RDONLY);
+		if(fd < 0)
+			throw v8_exception(std::string("Could not open `") + name + "`");
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			close(fd);
+			throw v8_exception(std::string("Could not stat `") + name + "`");
+		}
+		if(st.st_size > 0) {
+			size = st.st_size;
+			ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if(ptr == MAP_FAILED)
+			throw v8_exception(std::string("Could not map `") + name + "`");
+		// Let the kernel read ahead while the parser works on the first pages.
+		// Advice values are not flags, so they are given one at a time.
+		if(ptr) {
+			madvise(ptr, size, MADV_SEQUENTIAL);
+			madvise(ptr, size, MADV_WILLNEED);
+		}
+	}
+	~MappedFile() {
+		if(ptr && ptr != MAP_FAILED)
+			munmap(ptr, size);
+	}
+	const char *data() const { return ptr ? static_cast<const char*>(ptr) : ""; }
+	size_t length() const { return size; }
+private:
+	void *ptr = nullptr;
+	size_t size = 0;
+};
 
-	return std::string(data, size);
-}
+// Joins the thread when leaving scope, also when an exception is thrown
+struct JoiningThread {
+	~JoiningThread() {
+		if(thread.joinable())
+			thread.join();
+	}
+	void join() {
+		if(thread.joinable())
+			thread.join();
+	}
+	std::thread thread;
+};
+
+// Hands a file to the V8 script streamer in chunks. Runs on the parser thread.
+class MappedSourceStream : public v8::ScriptCompiler::ExternalSourceStream {
+public:
+	MappedSourceStream(const MappedFile &file) : file(file) {}
+
+	virtual size_t GetMoreData(const uint8_t **src) {
+		size_t n = file.length() - pos;
+		if(n > ChunkSize)
+			n = ChunkSize;
+		if(n == 0)
+			return 0;
+		// V8 takes ownership of the chunk
+		auto *chunk = new uint8_t[n];
+		memcpy(chunk, file.data() + pos, n);
+		pos += n;
+		*src = chunk;
+		return n;
+	}
+
+private:
+	static const size_t ChunkSize = 64 * 1024;
+	const MappedFile &file;
+	size_t pos = 0;
+};
 
 class ArrayBufferAllocator : public v8::ArrayBuffer::Allocator {
 public:
@@ -89,6 +158,40 @@ public:
 		tasks.emplace_back(task, delay + MonotonicallyIncreasingTime());
 	}
 
+	struct IdleTask
+	{
+		IdleTask(v8::Isolate *isolate, v8::IdleTask *task) : isolate(isolate), task(task) {}
+		v8::Isolate *isolate;
+		v8::IdleTask *task;
+	};
+
+	std::vector<IdleTask> idleTasks;
+
+	virtual void CallIdleOnForegroundThread(v8::Isolate *isolate, v8::IdleTask *task) {
+		idleTasks.emplace_back(isolate, task);
+	}
+
+	virtual bool IdleTasksEnabled(v8::Isolate *isolate) {
+		return true;
+	}
+
+	// Run the idle tasks of `isolate` until `deadline`, returns how many were run.
+	// Tasks posted while running are left for the next idle period.
+	int runIdleTasks(v8::Isolate *isolate, double deadline) {
+		std::vector<IdleTask> pending;
+		pending.swap(idleTasks);
+		int count = 0;
+		for(auto &t : pending) {
+			if(t.isolate == isolate && MonotonicallyIncreasingTime() < deadline) {
+				t.task->Run(deadline);
+				delete t.task;
+				count++;
+			} else
+				idleTasks.push_back(t);
+		}
+		return count;
+	}
+
 	void update() {
 		auto t = MonotonicallyIncreasingTime();
 		auto it = tasks.begin();
@@ -108,9 +211,18 @@ public:
 	}
 };
 
-V8Interpreter::V8Interpreter(bool start) {
+V8Interpreter::V8Interpreter(bool start) : V8Interpreter(HeapLimits(), start) {}
+
+V8Interpreter::V8Interpreter(const HeapLimits &limits, bool start) : heapLimits(limits) {
 	using namespace v8;
 	if(!platform) {
+		std::string flags;
+		if(perfOptions.perfMap)
+			flags += " --perf-basic-prof";
+		if(perfOptions.jitdump)
+			flags += " --perf-prof";
+		if(!flags.empty())
+			V8::SetFlagsFromString(flags.c_str(), flags.size());
 		V8::InitializeICU();
 		V8::InitializeExternalStartupData("");
 		platform = new MyPlatform();
@@ -120,7 +232,21 @@ V8Interpreter::V8Interpreter(bool start) {
 
 	Isolate::CreateParams create_params;
 	create_params.array_buffer_allocator = &allocator;
+	if(limits.semiSpace)
+		create_params.constraints.set_max_semi_space_size(limits.semiSpace);
+	if(limits.oldSpace)
+		create_params.constraints.set_max_old_space_size(limits.oldSpace);
+	if(limits.codeRange)
+		create_params.constraints.set_code_range_size(limits.codeRange);
 	isolate = Isolate::New(create_params);
+	isolate->SetData(InterpreterSlot, this);
+	isolate->SetData(ScriptStateSlot, &scriptState);
+	isolate->AddGCPrologueCallback(gcPrologue);
+	isolate->AddGCEpilogueCallback(gcEpilogue);
+#if V8_NEAR_HEAP_LIMIT_CALLBACK
+	if(limits.nearLimit != HeapLimits::Abort)
+		isolate->AddNearHeapLimitCallback(nearHeapLimit, this);
+#endif
 
 	Isolate::Scope isolate_scope(isolate);
 	HandleScope hs(isolate);
@@ -133,12 +259,20 @@ V8Interpreter::V8Interpreter(bool start) {
 		this->start();
 };
 
+void V8Interpreter::setPerfOptions(const PerfOptions &options) {
+	if(platform)
+		throw v8_exception("Perf options must be set before the first interpreter is created");
+	perfOptions = options;
+}
+
+// The platform is shared by all interpreters and V8 keeps using it after this
+// one is gone, so it lives for the whole process
 V8Interpreter::~V8Interpreter() {
+	JSKeyCache::release(isolate);
     //isolate->Dispose();
-    delete platform;
 }
 
-std::string V8Interpreter::exec(const std::string &source) {
+std::string V8Interpreter::exec(const std::string &source, double timeout) {
 	Scope scope{ isolate, context };
 
 	auto fn = v8::String::NewFromUtf8(isolate, source.c_str());
@@ -147,7 +281,7 @@ std::string V8Interpreter::exec(const std::string &source) {
 	auto script = v8::Script::Compile(fn);
 
 	// Run the script to get the result.
-	auto result = script->Run();
+	auto result = runWatched(script, timeout);
 
 	v8::String::Utf8Value utf8(result);
 	if(*utf8)
@@ -156,17 +290,51 @@ std::string V8Interpreter::exec(const std::string &source) {
 
 }
 
-std::string V8Interpreter::load(const std::string &fileName) {
+// Run a script under the watchdog, turning termination into v8_timeout. Script
+// exceptions are left to the caller's TryCatch.
+v8::Local<v8::Value> V8Interpreter::runWatched(v8::Local<v8::Script> script, double timeout) {
+	ScriptEntry entry(isolate, timeout);
+	auto result = script->Run();
+	entry.check();
+	return result;
+}
+
+void V8Interpreter::setCpuBudget(double seconds) {
+	scriptState.cpuBudget = seconds;
+	scriptState.cpuUsed = 0;
+}
+
+double V8Interpreter::cpuTimeUsed() const {
+	return scriptState.cpuUsed;
+}
+
+// The file is memory mapped and parsed on a background thread by the V8 script
+// streamer, while this thread creates the source string needed to compile it.
+std::string V8Interpreter::load(const std::string &fileName, double timeout) {
+	using namespace v8;
 	Scope scope{ isolate, context };
 
-	auto source_code = readFile(fileName);
-	auto fn = v8::String::NewFromUtf8(isolate, source_code.c_str());
+	MappedFile file(fileName);
+	ScriptCompiler::StreamedSource source(new MappedSourceStream(file), ScriptCompiler::StreamedSource::UTF8);
+	std::unique_ptr<ScriptCompiler::ScriptStreamingTask> task(ScriptCompiler::StartStreamingScript(isolate, &source));
+
+	JoiningThread parser;
+	if(task)
+		parser.thread = std::thread(&ScriptCompiler::ScriptStreamingTask::Run, task.get());
+
+	auto fn = String::NewFromUtf8(isolate, file.data(), String::kNormalString, file.length());
+	ScriptOrigin origin(to_js(isolate, fileName));
+
+	parser.join();
 
 	// Compile the source code.
-	auto script = v8::Script::Compile(fn);
+	TryCatch tc(isolate);
+	auto script = task ? ScriptCompiler::Compile(isolate, &source, fn, origin) : v8::Script::Compile(fn, &origin);
+	if(script.IsEmpty())
+		throw v8_exception(to_cpp<std::string>(tc.Exception()));
 
 	// Run the script to get the result.
-	auto result = script->Run();
+	auto result = runWatched(script, timeout);
 
 	v8::String::Utf8Value utf8(result);
 	if(*utf8)
@@ -174,15 +342,232 @@ std::string V8Interpreter::load(const std::string &fileName) {
 	return "";
 }
 
+V8Interpreter::Script V8Interpreter::compile(const std::string &source, const std::string &name) {
+	using namespace v8;
+	Scope scope{ isolate, context };
+
+	ScriptOrigin origin(to_js(isolate, name));
+	ScriptCompiler::Source src(String::NewFromUtf8(isolate, source.c_str(), String::kNormalString, source.size()), origin);
+
+	TryCatch tc(isolate);
+	Local<UnboundScript> script;
+	if(!ScriptCompiler::CompileUnboundScript(isolate, &src).ToLocal(&script))
+		throw v8_exception(to_cpp<std::string>(tc.Exception()));
+	return Script(*this, script);
+}
+
+// Bind a compiled script to the current context and run it. Needs a HandleScope.
+v8::Local<v8::Value> V8Interpreter::runScript(const Script::ScriptHandle &script, double timeout) {
+	using namespace v8;
+	auto s = Local<UnboundScript>::New(isolate, script)->BindToCurrentContext();
+	TryCatch tc(isolate);
+	auto result = runWatched(s, timeout);
+	if(tc.HasCaught())
+		throw v8_exception(to_cpp<std::string>(tc.Exception()));
+	return result;
+}
+
+// Make sure an expression can not end the function it is compiled into. It must
+// parse on its own both in parentheses and in brackets: closing the function
+// needs a `)` the expression did not open, which the bracket version rejects.
+// Nothing is run. Needs a HandleScope and context.
+void V8Interpreter::checkExpression(const std::string &expression, const std::vector<std::string> &params) {
+	using namespace v8;
+	for(auto &p : params) {
+		// Names starting with __ are used by the batch loop
+		bool ok = !p.empty() && !isdigit((unsigned char)p[0]) && p.compare(0, 2, "__") != 0;
+		for(char c : p)
+			ok = ok && (isalnum((unsigned char)c) || c == '_' || c == '$');
+		if(!ok)
+			throw v8_exception("`" + p + "` is not a valid parameter name");
+	}
+
+	for(auto &wrapped : { "(" + expression + "\n)", "[" + expression + "\n]" }) {
+		TryCatch tc(isolate);
+		ScriptCompiler::Source source(String::NewFromUtf8(isolate, wrapped.c_str(), String::kNormalString, wrapped.size()));
+		Local<UnboundScript> script;
+		if(!ScriptCompiler::CompileUnboundScript(isolate, &source).ToLocal(&script))
+			throw v8_exception("Expression `" + expression + "` is not a single expression: " + to_cpp<std::string>(tc.Exception()));
+	}
+}
+
+// Compile a function from its body and parameter names, without running any script
+v8::Local<v8::Function> V8Interpreter::compileFunction(const std::string &body, const std::vector<std::string> &params) {
+	using namespace v8;
+	TryCatch tc(isolate);
+	std::vector<Local<String>> names;
+	for(auto &p : params)
+		names.push_back(to_key(isolate, p));
+	ScriptCompiler::Source source(String::NewFromUtf8(isolate, body.c_str(), String::kNormalString, body.size()));
+	auto fn = ScriptCompiler::CompileFunctionInContext(isolate->GetCurrentContext(), &source, names.size(), names.data(), 0, nullptr);
+	if(fn.IsEmpty())
+		throw v8_exception(to_cpp<std::string>(tc.Exception()));
+	return fn.ToLocalChecked();
+}
+
 void V8Interpreter::start() {
+	// Create the global object and context for this interpreter
+	context = newContext();
+}
+
+v8::UniquePersistent<v8::Context> V8Interpreter::newContext() {
 	using namespace v8;
 	Isolate::Scope isolate_scope(isolate);
 	HandleScope  hs(isolate);
 
-	// Create the global object and context for this interpreter
+	// A template can not be changed once it has been used, so bindings added since
+	// then go on a new one and every new context still gets them from the template
+	if(templateStale) {
+		auto ot = ObjectTemplate::New(isolate);
+		for(auto &b : bindings)
+			ot->SetAccessor(intern_key(isolate, b.first), lazy_get, lazy_set, External::New(isolate, &b.second));
+		global_templ.Reset(isolate, ot);
+		templateStale = false;
+	}
+
 	Local<ObjectTemplate> got = Local<ObjectTemplate>::New(isolate, global_templ);
 	auto c = Context::New(isolate, nullptr, got);
-	context.Reset(isolate, c);
+	for(auto &o : globalObjects)
+		installGlobalObject(c, o);
+	return UniquePersistent<Context>(isolate, c);
+}
+
+void V8Interpreter::warmContexts(int count) {
+	poolSize = count;
+	while((int)contextPool.size() < count)
+		contextPool.push_back(newContext());
+}
+
+V8Interpreter::ContextLease V8Interpreter::acquireContext() {
+	if(contextPool.empty())
+		return ContextLease(*this, newContext());
+	auto c = std::move(contextPool.back());
+	contextPool.pop_back();
+	return ContextLease(*this, std::move(c));
+}
+
+V8Interpreter::ContextLease::ContextLease(V8Interpreter &v8, v8::UniquePersistent<v8::Context> c) : v8(&v8), depth(v8.leasedFrom.size()) {
+	v8.leasedFrom.push_back(std::move(v8.context));
+	v8.context = std::move(c);
+}
+
+V8Interpreter::ContextLease::ContextLease(ContextLease &&other) : v8(other.v8), depth(other.depth) {
+	other.v8 = nullptr;
+}
+
+V8Interpreter::ContextLease::~ContextLease() {
+	release();
+}
+
+// Drop the leased context and switch back to the one that was active before
+void V8Interpreter::ContextLease::release() {
+	if(!v8)
+		return;
+	// Leases must be released in the reverse order they were acquired
+	assert(depth == v8->leasedFrom.size() - 1);
+	v8->context.Reset();
+	v8->context = std::move(v8->leasedFrom.back());
+	v8->leasedFrom.pop_back();
+	v8 = nullptr;
+}
+
+static const JSKey &mapKey() {
+	static const JSKey key("map");
+	return key;
+}
+
+v8::Local<v8::FunctionTemplate> V8Interpreter::GlobalBinding::getTemplate(v8::Isolate *isolate) {
+	using namespace v8;
+	if(templ.IsEmpty()) {
+		auto ft = FunctionTemplate::New(isolate, callback, External::New(isolate, overloads.caller()));
+		if(overloads.vectorized) {
+			auto vt = FunctionTemplate::New(isolate, callback, External::New(isolate, overloads.vectorized));
+			ft->Set(mapKey().get(isolate), vt);
+		}
+		templ.Reset(isolate, ft);
+	}
+	return Local<FunctionTemplate>::New(isolate, templ);
+}
+
+void V8Interpreter::setGlobalFunction(GlobalBinding &binding) {
+	using namespace v8;
+
+	HandleScope hs(isolate); // All Locals go into this scope
+	binding.templ.Reset();
+
+	// Before the first context is created the binding goes on the global template.
+	// After that, contexts that already exist get it separately.
+	if(context.IsEmpty() && leasedFrom.empty() && contextPool.empty()) {
+		auto got = Local<ObjectTemplate>::New(isolate, global_templ);
+		got->SetAccessor(intern_key(isolate, binding.overloads.name), lazy_get, lazy_set, External::New(isolate, &binding));
+		return;
+	}
+
+	templateStale = true;
+	if(!context.IsEmpty())
+		installBinding(Local<Context>::New(isolate, context), binding);
+	for(auto &c : leasedFrom) {
+		if(!c.IsEmpty())
+			installBinding(Local<Context>::New(isolate, c), binding);
+	}
+	for(auto &c : contextPool)
+		installBinding(Local<Context>::New(isolate, c), binding);
+}
+
+// Add a binding to a context created before it was registered
+void V8Interpreter::installBinding(v8::Local<v8::Context> c, GlobalBinding &binding) {
+	using namespace v8;
+	Context::Scope context_scope(c);
+	auto key = intern_key(isolate, binding.overloads.name);
+	Handle<Object> v8RealGlobal = Handle<Object>::Cast(c->Global()->GetPrototype());
+	v8RealGlobal->Delete(key);
+	v8RealGlobal->SetAccessor(key, lazy_get, lazy_set, External::New(isolate, &binding));
+}
+
+void V8Interpreter::addGlobalObject(GlobalObject &o) {
+	using namespace v8;
+	IsolateEntry ie(isolate);
+	HandleScope hs(isolate);
+	if(!context.IsEmpty())
+		installGlobalObject(Local<Context>::New(isolate, context), o);
+	for(auto &c : leasedFrom) {
+		if(!c.IsEmpty())
+			installGlobalObject(Local<Context>::New(isolate, c), o);
+	}
+	for(auto &c : contextPool)
+		installGlobalObject(Local<Context>::New(isolate, c), o);
+}
+
+void V8Interpreter::installGlobalObject(v8::Local<v8::Context> c, GlobalObject &o) {
+	using namespace v8;
+	Context::Scope context_scope(c);
+	Handle<Object> v8RealGlobal = Handle<Object>::Cast(c->Global()->GetPrototype());
+	v8RealGlobal->Set(intern_key(isolate, o.name), o.create());
+}
+
+// Replace the accessor with the actual function the first time it is read
+void V8Interpreter::lazy_get(v8::Local<v8::String> name, const v8::PropertyCallbackInfo<v8::Value> &info) {
+	using namespace v8;
+	auto *isolate = info.GetIsolate();
+	auto *binding = static_cast<GlobalBinding*>(Local<External>::Cast(info.Data())->Value());
+	auto fun = binding->getTemplate(isolate)->GetFunction();
+	// Native bindings show up under their registered name in profiles and stack traces
+	fun->SetName(name);
+	if(binding->overloads.vectorized) {
+		auto map = Local<Function>::Cast(fun->Get(mapKey().get(isolate)));
+		map->SetName(intern_key(isolate, binding->overloads.name + ".map"));
+	}
+	if(info.Holder()->DefineOwnProperty(isolate->GetCurrentContext(), name, fun).IsNothing())
+		return;
+	info.GetReturnValue().Set(fun);
+}
+
+// Scripts may overwrite a binding that was never read
+void V8Interpreter::lazy_set(v8::Local<v8::String> name, v8::Local<v8::Value> val, const v8::PropertyCallbackInfo<void> &info) {
+	auto *isolate = info.GetIsolate();
+	// On failure an exception is pending and propagates to the script
+	if(info.Holder()->DefineOwnProperty(isolate->GetCurrentContext(), name, val).IsNothing())
+		return;
 }
 
 // Static callback function that extracts a V8FunctionCaller functor and calls it
@@ -190,9 +575,295 @@ void V8Interpreter::callback(const v8::FunctionCallbackInfo<v8::Value> &v) {
 	using namespace v8;
 	void *ex = External::Cast(*v.Data())->Value();
 	auto *f = static_cast<V8FunctionCaller*>(ex);
+	BINDING_STATS_SCOPE(f->statsId);
 	f->call(v);
 };
 
+void V8Interpreter::gcPrologue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags) {
+	auto *v8 = static_cast<V8Interpreter*>(isolate->GetData(InterpreterSlot));
+	v8->gcStats.begin(type);
+}
+
+void V8Interpreter::gcEpilogue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags) {
+	auto *v8 = static_cast<V8Interpreter*>(isolate->GetData(InterpreterSlot));
+	v8->gcStats.end(type);
+#if !V8_NEAR_HEAP_LIMIT_CALLBACK
+	// Without a near heap limit callback, check after each full GC instead. The
+	// limit can not be raised here, so GrowOnce also terminates.
+	if(v8->heapLimits.nearLimit != HeapLimits::Abort && (type & v8::kGCTypeMarkSweepCompact)) {
+		v8::HeapStatistics hs;
+		isolate->GetHeapStatistics(&hs);
+		// Only a running script can be terminated, a GC from C++ or idle() is left alone
+		auto &state = v8->scriptState;
+		if(state.depth > 0 && hs.used_heap_size() > hs.heap_size_limit() / 10 * 9 && !state.heapTerminated) {
+			state.heapTerminated = true;
+			isolate->TerminateExecution();
+		}
+	}
+#endif
+}
+
+// Called by V8 when the heap is about to run out, returns the new limit
+size_t V8Interpreter::nearHeapLimit(void *data, size_t currentLimit, size_t initialLimit) {
+	auto *v8 = static_cast<V8Interpreter*>(data);
+	if(v8->heapLimits.nearLimit == HeapLimits::GrowOnce && !v8->heapGrown) {
+		v8->heapGrown = true;
+		return currentLimit + (size_t)(currentLimit * v8->heapLimits.growBy);
+	}
+	// Terminating still needs some heap to unwind the script. With no script
+	// running there is nothing to terminate, and the extra room is all we can give.
+	auto &state = v8->scriptState;
+	if(state.depth > 0 && !state.heapTerminated) {
+		state.heapTerminated = true;
+		v8->isolate->TerminateExecution();
+	}
+	return currentLimit + currentLimit / 10;
+}
+
+HeapInfo V8Interpreter::heapStatistics() {
+	using namespace v8;
+	HeapStatistics hs;
+	isolate->GetHeapStatistics(&hs);
+	HeapInfo info { hs.total_heap_size(), hs.total_heap_size_executable(), hs.total_physical_size(), hs.used_heap_size(), hs.heap_size_limit(), {} };
+	for(size_t i = 0; i < isolate->NumberOfHeapSpaces(); i++) {
+		HeapSpaceStatistics ss;
+		if(isolate->GetHeapSpaceStatistics(&ss, i))
+			info.spaces.push_back(HeapSpaceInfo { ss.space_name(), ss.space_size(), ss.space_used_size(), ss.space_available_size(), ss.physical_space_size() });
+	}
+	return info;
+}
+
+void V8Interpreter::writeMetrics(std::ostream &os) {
+	auto heap = heapStatistics();
+
+	os << "# TYPE v8_heap_size_bytes gauge\n";
+	os << "v8_heap_size_bytes " << heap.totalHeapSize << "\n";
+	os << "# TYPE v8_heap_executable_bytes gauge\n";
+	os << "v8_heap_executable_bytes " << heap.totalHeapSizeExecutable << "\n";
+	os << "# TYPE v8_heap_physical_bytes gauge\n";
+	os << "v8_heap_physical_bytes " << heap.totalPhysicalSize << "\n";
+	os << "# TYPE v8_heap_used_bytes gauge\n";
+	os << "v8_heap_used_bytes " << heap.usedHeapSize << "\n";
+	os << "# TYPE v8_heap_limit_bytes gauge\n";
+	os << "v8_heap_limit_bytes " << heap.heapSizeLimit << "\n";
+
+	os << "# TYPE v8_heap_space_size_bytes gauge\n";
+	for(auto &s : heap.spaces)
+		os << "v8_heap_space_size_bytes{space=\"" << s.name << "\"} " << s.size << "\n";
+	os << "# TYPE v8_heap_space_used_bytes gauge\n";
+	for(auto &s : heap.spaces)
+		os << "v8_heap_space_used_bytes{space=\"" << s.name << "\"} " << s.used << "\n";
+	os << "# TYPE v8_heap_space_available_bytes gauge\n";
+	for(auto &s : heap.spaces)
+		os << "v8_heap_space_available_bytes{space=\"" << s.name << "\"} " << s.available << "\n";
+
+	os << "# TYPE v8_gc_pause_seconds histogram\n";
+	for(int t = 0; t < GCStats::Types; t++) {
+		std::string type = GCStats::typeName(t);
+		uint64_t cumulative = 0;
+		for(int b = 0; b < GCStats::Buckets; b++) {
+			cumulative += gcStats.buckets[t][b];
+			os << "v8_gc_pause_seconds_bucket{type=\"" << type << "\",le=\"";
+			if(b == GCStats::Buckets - 1)
+				os << "+Inf";
+			else
+				os << GCStats::bucketLimits()[b];
+			os << "\"} " << cumulative << "\n";
+		}
+		os << "v8_gc_pause_seconds_sum{type=\"" << type << "\"} " << gcStats.totalUs[t] / 1000000.0 << "\n";
+		os << "v8_gc_pause_seconds_count{type=\"" << type << "\"} " << gcStats.count[t] << "\n";
+	}
+
+	os << "# TYPE v8_wrappers_alive gauge\n";
+	for(auto &c : WrapperStats::counts())
+		os << "v8_wrappers_alive{class=\"" << c.first << "\"} " << c.second << "\n";
+}
+
+void V8Interpreter::writeMetrics(const std::string &path) {
+	std::ofstream os(path);
+	if(!os)
+		throw v8_exception(std::string("Could not write `") + path + "`");
+	writeMetrics(os);
+}
+
+void V8Interpreter::startProfiling(const std::string &name, int samplingIntervalUs) {
+	using namespace v8;
+	Isolate::Scope isolate_scope(isolate);
+	HandleScope hs(isolate);
+	auto *profiler = isolate->GetCpuProfiler();
+	profiler->SetSamplingInterval(samplingIntervalUs);
+	profiler->StartProfiling(to_js<std::string, String>(isolate, name), true);
+}
+
+static std::string jsonString(const std::string &s) {
+	std::string out = "\"";
+	for(char c : s) {
+		switch(c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if((unsigned char)c < 0x20) {
+				char esc[8];
+				snprintf(esc, sizeof(esc), "\\u%04x", c);
+				out += esc;
+			} else
+				out += c;
+		}
+	}
+	return out + "\"";
+}
+
+static void writeProfileNode(std::ostream &os, const v8::CpuProfileNode *node, bool &first) {
+	if(!first)
+		os << ",";
+	first = false;
+	auto name = to_cpp<std::string>(node->GetFunctionName());
+	os << "{\"id\":" << node->GetNodeId()
+	   << ",\"callFrame\":{\"functionName\":" << jsonString(name.empty() ? "(anonymous)" : name)
+	   << ",\"scriptId\":\"" << node->GetScriptId() << "\""
+	   << ",\"url\":" << jsonString(to_cpp<std::string>(node->GetScriptResourceName()))
+	   << ",\"lineNumber\":" << node->GetLineNumber() - 1
+	   << ",\"columnNumber\":" << node->GetColumnNumber() - 1
+	   << "},\"hitCount\":" << node->GetHitCount()
+	   << ",\"children\":[";
+	int n = node->GetChildrenCount();
+	for(int i = 0; i < n; i++)
+		os << (i ? "," : "") << node->GetChild(i)->GetNodeId();
+	os << "]}";
+	for(int i = 0; i < n; i++)
+		writeProfileNode(os, node->GetChild(i), first);
+}
+
+void V8Interpreter::stopProfiling(const std::string &name, const std::string &path) {
+	using namespace v8;
+	Isolate::Scope isolate_scope(isolate);
+	HandleScope hs(isolate);
+	auto *profile = isolate->GetCpuProfiler()->StopProfiling(to_js<std::string, String>(isolate, name));
+	if(!profile)
+		throw v8_exception(std::string("No profile named `") + name + "`");
+
+	std::ofstream os(path);
+	if(!os) {
+		profile->Delete();
+		throw v8_exception(std::string("Could not write `") + path + "`");
+	}
+
+	bool first = true;
+	os << "{\"nodes\":[";
+	writeProfileNode(os, profile->GetTopDownRoot(), first);
+	os << "],\"startTime\":" << profile->GetStartTime() << ",\"endTime\":" << profile->GetEndTime();
+	os << ",\"samples\":[";
+	int samples = profile->GetSamplesCount();
+	for(int i = 0; i < samples; i++)
+		os << (i ? "," : "") << profile->GetSample(i)->GetNodeId();
+	os << "],\"timeDeltas\":[";
+	int64_t last = profile->GetStartTime();
+	for(int i = 0; i < samples; i++) {
+		int64_t t = profile->GetSampleTimestamp(i);
+		os << (i ? "," : "") << t - last;
+		last = t;
+	}
+	os << "]}";
+	profile->Delete();
+}
+
+// Labels the C++ object behind a wrapper in heap snapshots
+class WrapperInfo : public v8::RetainedObjectInfo {
+public:
+	WrapperInfo(WrapperStats::Class *c, void *ptr) : c(c), ptr(ptr) {}
+	void Dispose() override { delete this; }
+	bool IsEquivalent(v8::RetainedObjectInfo *other) override {
+		return GetHash() == other->GetHash() && strcmp(GetLabel(), other->GetLabel()) == 0;
+	}
+	intptr_t GetHash() override { return reinterpret_cast<intptr_t>(ptr); }
+	const char *GetLabel() override { return c->name.c_str(); }
+	intptr_t GetSizeInBytes() override { return c->size; }
+private:
+	WrapperStats::Class *c;
+	void *ptr;
+};
+
+static v8::RetainedObjectInfo *wrapperInfo(uint16_t classId, v8::Local<v8::Value> wrapper) {
+	using namespace v8;
+	auto *c = WrapperStats::byId(classId);
+	if(!c || !wrapper->IsObject())
+		return nullptr;
+	auto obj = Local<Object>::Cast(wrapper);
+	if(obj->InternalFieldCount() == 0)
+		return nullptr;
+	return new WrapperInfo(c, obj->GetAlignedPointerFromInternalField(0));
+}
+
+class FileOutputStream : public v8::OutputStream {
+public:
+	FileOutputStream(std::ostream &os) : os(os) {}
+	void EndOfStream() override { os.flush(); }
+	WriteResult WriteAsciiChunk(char *data, int size) override {
+		os.write(data, size);
+		return os ? kContinue : kAbort;
+	}
+private:
+	std::ostream &os;
+};
+
+void V8Interpreter::writeHeapSnapshot(const std::string &path) {
+	using namespace v8;
+	std::ofstream os(path);
+	if(!os)
+		throw v8_exception(std::string("Could not write `") + path + "`");
+
+	Isolate::Scope isolate_scope(isolate);
+	HandleScope hs(isolate);
+	auto *profiler = isolate->GetHeapProfiler();
+	for(auto id : WrapperStats::classIds())
+		profiler->SetWrapperClassInfoProvider(id, wrapperInfo);
+
+	auto *snapshot = const_cast<HeapSnapshot*>(profiler->TakeHeapSnapshot());
+	FileOutputStream out(os);
+	snapshot->Serialize(&out, HeapSnapshot::kJSON);
+	snapshot->Delete();
+	if(!os)
+		throw v8_exception(std::string("Could not write `") + path + "`");
+}
+
+IdleWork V8Interpreter::idle(double deadlineSeconds, bool lowMemory) {
+	using namespace v8;
+	IsolateEntry ie(isolate);
+	HandleScope hs(isolate);
+	auto *p = static_cast<MyPlatform*>(platform);
+	double start = p->MonotonicallyIncreasingTime();
+	double deadline = start + deadlineSeconds;
+
+	HeapStatistics before;
+	isolate->GetHeapStatistics(&before);
+	uint64_t gcBefore = 0;
+	for(int t = 0; t < GCStats::Types; t++)
+		gcBefore += gcStats.count[t];
+
+	IdleWork work;
+	work.tasks = p->runIdleTasks(isolate, deadline);
+	while(contextPool.size() < poolSize && p->MonotonicallyIncreasingTime() < deadline) {
+		contextPool.push_back(newContext());
+		work.contexts++;
+	}
+	if(lowMemory)
+		isolate->LowMemoryNotification();
+	else if(p->MonotonicallyIncreasingTime() < deadline)
+		work.done = isolate->IdleNotificationDeadline(deadline);
+
+	HeapStatistics after;
+	isolate->GetHeapStatistics(&after);
+	for(int t = 0; t < GCStats::Types; t++)
+		work.collections += gcStats.count[t];
+	work.collections -= gcBefore;
+	work.freedBytes = before.used_heap_size() > after.used_heap_size() ? before.used_heap_size() - after.used_heap_size() : 0;
+	work.seconds = p->MonotonicallyIncreasingTime() - start;
+	return work;
+}
+
 void V8Interpreter::update() {
 	((MyPlatform*)platform)->update();
 }
@@ -235,6 +906,7 @@ std::shared_ptr<V8Interpreter::REPL> V8Interpreter::startREPL() {
 #endif
 
 v8::Platform *V8Interpreter::platform = nullptr;
+PerfOptions V8Interpreter::perfOptions;
 
 
 #ifdef TESTME
@@ -291,4 +963,513 @@ TEST_CASE("Interpreter works", "") {
 	)");
 }
 
+struct point {
+	double x = 0;
+	double y = 0;
+};
+
+TEST_CASE("Value mode classes", "") {
+	V8Interpreter v8;
+
+	v8.registerClass<point>()
+			.field("x", &point::x)
+			.field("y", &point::y)
+			.valueMode(ValueMode::PlainObject)
+			;
+
+	v8.registerFunction("midpoint", [](point a, point b) -> point {
+		point p;
+		p.x = (a.x + b.x) / 2;
+		p.y = (a.y + b.y) / 2;
+		return p;
+	});
+
+	REQUIRE(v8.exec("var p = midpoint({ x: 2, y: 0 }, { x: 4, y: 8 }); p.x + ',' + p.y") == "3,4");
+	REQUIRE(v8.exec("Object.keys(midpoint(p, p)).join()") == "x,y");
+}
+
+struct size2 {
+	double w = 0;
+	double h = 0;
+};
+
+TEST_CASE("Value mode fields added late", "") {
+	V8Interpreter v8;
+
+	v8.registerClass<size2>()
+			.field("w", &size2::w)
+			.valueMode(ValueMode::PlainObject)
+			.field("h", &size2::h)
+			;
+
+	v8.registerFunction("grow", [](size2 s) -> size2 {
+		s.w *= 2;
+		s.h *= 2;
+		return s;
+	});
+
+	REQUIRE(v8.exec("var s = grow({ w: 1, h: 2 }); s.w + ',' + s.h") == "2,4");
+}
+
+struct rgb {
+	double r = 0;
+	double g = 0;
+	double b = 0;
+};
+
+struct quat {
+	double x = 0;
+	double y = 0;
+	double z = 0;
+	double w = 0;
+};
+
+TEST_CASE("Typed array value modes", "") {
+	V8Interpreter v8;
+
+	v8.registerClass<rgb>()
+			.field("r", &rgb::r)
+			.field("g", &rgb::g)
+			.field("b", &rgb::b)
+			.valueMode(ValueMode::Float32Array)
+			;
+	v8.registerClass<quat>()
+			.field("x", &quat::x)
+			.field("y", &quat::y)
+			.field("z", &quat::z)
+			.field("w", &quat::w)
+			.valueMode(ValueMode::Float64Array)
+			;
+
+	rgb seen;
+	v8.registerFunction("brighten", [&](rgb c) -> rgb {
+		seen = c;
+		c.r *= 2;
+		c.g *= 2;
+		c.b *= 2;
+		return c;
+	});
+	v8.registerFunction("tenth", []() -> rgb {
+		rgb c;
+		c.r = 0.1;
+		return c;
+	});
+	v8.registerFunction("scale", [](quat q, double f) -> quat {
+		q.x *= f;
+		q.y *= f;
+		q.z *= f;
+		q.w *= f;
+		return q;
+	});
+
+	// Float32Array: elements are narrowed to float on the way out
+	REQUIRE(v8.exec("var c = brighten(new Float32Array([1, 2, 3])); (c instanceof Float32Array) + ':' + c.length + ':' + c[2]") == "true:3:6");
+	REQUIRE(seen.g == 2);
+	REQUIRE(v8.exec("var t = tenth(); (t[0] === Math.fround(0.1)) + ':' + (t[0] === 0.1)") == "true:false");
+	REQUIRE(v8.exec("brighten({ r: 1, g: 2, b: 3 })[1]") == "4");
+	REQUIRE(v8.exec("brighten(c)[0]") == "4");
+
+	// Float64Array: doubles round trip exactly
+	REQUIRE(v8.exec("var q = scale(new Float64Array([0.1, 0.2, 0.3, 0.4]), 1); (q instanceof Float64Array) + ':' + q.length + ':' + (q[0] === 0.1)") == "true:4:true");
+	REQUIRE(v8.exec("scale(q, 2)[3]") == "0.8");
+}
+
+struct tally {
+	int n = 0;
+	int add(int v) { return n += v; }
+	static int zero() { return 0; }
+};
+
+TEST_CASE("Overloaded functions", "") {
+	V8Interpreter v8;
+
+	v8.registerFunction("describe", [](double d) -> string { return "number"; });
+	v8.registerFunction("describe", [](string s) -> string { return "string"; });
+	v8.registerFunction("describe", [](double a, double b) -> string { return "pair"; });
+
+	REQUIRE(v8.exec("describe(1)") == "number");
+	REQUIRE(v8.exec("describe('x')") == "string");
+	REQUIRE(v8.exec("describe(1, 2)") == "pair");
+	REQUIRE(v8.exec("try { describe(1, 2, 3); 'no error' } catch(e) { e instanceof TypeError }") == "true");
+
+	auto &c = v8.registerClass<tally>().method("add", &tally::add);
+	REQUIRE_THROWS_AS(c.method("add", &tally::zero), const v8_exception&);
+}
+
+TEST_CASE("Loading files", "") {
+	V8Interpreter v8;
+
+	std::string name = "/tmp/v8interpreter_load_test.js";
+	{
+		std::ofstream os(name);
+		os << "var loaded = 0;\nfor(var i = 0; i < 10; i++) loaded += i;\nloaded";
+	}
+	REQUIRE(v8.load(name) == "45");
+	REQUIRE(v8.exec("loaded") == "45");
+	remove(name.c_str());
+
+	REQUIRE_THROWS_AS(v8.load("/tmp/v8interpreter_no_such_file.js"), const v8_exception&);
+}
+
+TEST_CASE("Compiled scripts", "") {
+	V8Interpreter v8;
+
+	auto s = v8.compile("limit * 2 > 10", "rule");
+	v8.exec("var limit = 4");
+	REQUIRE(s.run<bool>() == false);
+	v8.exec("limit = 6");
+	REQUIRE(s.run<bool>() == true);
+	REQUIRE(v8.compile("limit + 0.5").run<double>() == 6.5);
+}
+
+TEST_CASE("Compiled expressions", "") {
+	V8Interpreter v8;
+
+	auto e = v8.compileExpression<bool(double, double, double)>("a * 2 + b > c", { "a", "b", "c" });
+	REQUIRE(e(1, 1, 2) == true);
+	REQUIRE(e(1, 0, 2) == false);
+
+	double a[] = { 1, 1, 3 };
+	double b[] = { 1, 0, 0 };
+	double c[] = { 2, 2, 7 };
+	bool out[3];
+	e.batch(3, out, a, b, c);
+	REQUIRE(out[0] == true);
+	REQUIRE(out[1] == false);
+	REQUIRE(out[2] == false);
+
+	REQUIRE_THROWS_AS(v8.compileExpression<double(double)>("0); }); evil(); (function() { return (0", { "a" }), const v8_exception&);
+	REQUIRE_THROWS_AS(v8.compileExpression<double(double)>("/'/); }); evil(); (function() { return (/'/", { "a" }), const v8_exception&);
+	REQUIRE(v8.compileExpression<double(double)>("a // half\n / 2", { "a" })(4) == 2);
+	REQUIRE_THROWS_AS(v8.compileExpression<double(double)>("a", { "a) { evil(); } function(" }), const v8_exception&);
+	REQUIRE(v8.compileExpression<double(double)>("a + ')'.length", { "a" })(1) == 2);
+}
+
+struct settings {
+	int level = 0;
+};
+
+TEST_CASE("Context leases", "") {
+	V8Interpreter v8;
+
+	v8.registerFunction("add", [](int a, int b) -> int { return a + b; });
+	v8.warmContexts(2);
+	{
+		auto lease = v8.acquireContext();
+		REQUIRE(v8.exec("var leased = add(1, 2); leased") == "3");
+	}
+	REQUIRE(v8.exec("typeof leased") == "undefined");
+
+	// Leases empty the pool, and idle() fills it again
+	{
+		auto a = v8.acquireContext();
+		auto b = v8.acquireContext();
+	}
+	REQUIRE(v8.idle(1).contexts == 2);
+
+	static settings cfg;
+	cfg.level = 3;
+	v8.registerClass<settings>().field("level", &settings::level);
+	v8.addGlobalObject("cfg", &cfg);
+	{
+		auto lease = v8.acquireContext();
+		REQUIRE(v8.exec("cfg.level") == "3");
+	}
+}
+
+TEST_CASE("Functions registered after contexts exist", "") {
+	V8Interpreter v8;
+
+	v8.warmContexts(2);
+	{
+		auto lease = v8.acquireContext();
+		v8.registerFunction("seven", []() -> int { return 7; });
+		REQUIRE(v8.exec("seven()") == "7");
+	}
+	// Main context, pooled context, and a new context from the rebuilt template
+	REQUIRE(v8.exec("seven()") == "7");
+	{
+		auto lease = v8.acquireContext();
+		REQUIRE(v8.exec("seven()") == "7");
+	}
+	{
+		auto lease = v8.acquireContext();
+		REQUIRE(v8.exec("seven()") == "7");
+	}
+}
+
+TEST_CASE("Vectorized functions", "") {
+	V8Interpreter v8;
+
+	v8.registerFunction("halve", [](float f) -> float { return f / 2; });
+
+	REQUIRE(v8.exec("halve(8)") == "4");
+	REQUIRE(v8.exec("var a = halve.map(new Float32Array([2, 4, 6])); a.length + ':' + a[2]") == "3:3");
+	REQUIRE(v8.exec("var b = new Float32Array(3); halve.map(a, b); b[0]") == "0.5");
+	REQUIRE(v8.exec("try { halve.map(new Int8Array(2)); 'no error' } catch(e) { e instanceof TypeError }") == "true");
+}
+
+TEST_CASE("Script deadlines", "") {
+	V8Interpreter v8;
+
+	REQUIRE_THROWS_AS(v8.exec("while(true) {}", 0.05), const v8_timeout&);
+	REQUIRE(v8.exec("1 + 1", 0.05) == "2");
+
+	v8.setCpuBudget(0.05);
+	REQUIRE_THROWS_AS(v8.exec("while(true) {}"), const v8_timeout&);
+	REQUIRE_THROWS_AS(v8.exec("1 + 1"), const v8_timeout&);
+
+	// Function calls are charged to the same budget
+	V8Interpreter v8b;
+	v8b.exec("function spin() { while(true) {} }");
+	auto spin = v8b.getFunction<void()>("spin");
+	v8b.setCpuBudget(0.05);
+	REQUIRE_THROWS_AS(spin(), const v8_timeout&);
+	REQUIRE(v8b.cpuTimeUsed() >= 0.04);
+	REQUIRE_THROWS_AS(spin(), const v8_timeout&);
+}
+
+TEST_CASE("Idle time GC", "") {
+	V8Interpreter v8;
+
+	v8.exec("var garbage = []; for(var i = 0; i < 100000; i++) garbage.push({ i: i }); garbage = null;");
+	auto work = v8.idle(0.1, true);
+	REQUIRE(work.collections > 0);
+	REQUIRE(work.freedBytes > 0);
+}
+
+TEST_CASE("Heap limits", "") {
+	HeapLimits limits;
+	limits.oldSpace = 64;
+	limits.nearLimit = HeapLimits::Terminate;
+	V8Interpreter v8(limits);
+
+	v8.exec("var hog = []; function grow() { while(true) hog.push(new Array(1000).join('x') + Math.random()); }");
+	REQUIRE_THROWS_AS(v8.exec("grow()"), const v8_heap_limit&);
+	REQUIRE(v8.exec("hog = []; 1 + 1") == "2");
+
+	auto grow = v8.getFunction<void()>("grow");
+	REQUIRE_THROWS_AS(grow(), const v8_heap_limit&);
+	REQUIRE(v8.exec("hog = []; 2 + 2") == "4");
+}
+
+TEST_CASE("Heap metrics", "") {
+	V8Interpreter v8;
+
+	v8.exec("var garbage = []; for(var i = 0; i < 100000; i++) garbage.push({ i: i }); garbage = null;");
+	auto heap = v8.heapStatistics();
+	REQUIRE(heap.usedHeapSize > 0);
+	REQUIRE(!heap.spaces.empty());
+
+	std::stringstream ss;
+	v8.writeMetrics(ss);
+	REQUIRE(ss.str().find("v8_heap_used_bytes ") != std::string::npos);
+	REQUIRE(ss.str().find("v8_gc_pause_seconds_bucket{type=\"scavenge\",le=\"+Inf\"}") != std::string::npos);
+}
+
+TEST_CASE("Calling JS functions", "") {
+	V8Interpreter v8;
+
+	v8.exec("function score(a, b) { return a * 10 + b; }");
+	auto score = v8.getFunction<double(double, double)>("score");
+	REQUIRE(score(3, 4) == 34);
+	REQUIRE(score(1, 2) == 12);
+
+	v8.registerFunction("twice", [](std::function<int(int)> f) -> int {
+		return f(f(1));
+	});
+	REQUIRE(v8.exec("twice(function(x) { return x + 2; })") == "5");
+	v8.registerFunction("once", [](std::function<int(int)> f) -> int {
+		return f(1);
+	});
+	REQUIRE(v8.exec("try { once(function(x) { throw 'bad'; }); 'no error' } catch(e) { e }") == "bad");
+
+	vector<double> in { 1, 2, 3, 4, 5 };
+	vector<double> out;
+	v8.exec("function square(x) { return x * x; }");
+	v8.map(v8.getFunction<double(double)>("square"), in.begin(), in.end(), back_inserter(out), 2);
+	REQUIRE(out == vector<double>({ 1, 4, 9, 16, 25 }));
+}
+
+TEST_CASE("Keeping JS objects", "") {
+	V8Interpreter v8;
+
+	JSObjectRef ref = v8.compile("({ name: 'big', items: [1, 2, 3] })").run<JSObjectRef>();
+	REQUIRE(JSObjectRef::count() == 1);
+	REQUIRE(JSObjectRef::bytes() == ref.byteSize());
+	REQUIRE(ref.byteSize() > 2 * sizeof(void*));
+
+	v8.idle(0.1, true);
+	ref = std::move(ref);
+	{
+		JSObjectRef::Scope scope(ref);
+		REQUIRE((*scope)["name"].toString() == "big");
+		REQUIRE((*scope)["items"][2].toInt() == 3);
+	}
+
+	ref.release();
+	REQUIRE(ref.empty());
+	REQUIRE(JSObjectRef::count() == 0);
+	REQUIRE(JSObjectRef::bytes() == 0);
+}
+
+struct request {
+	int id = 0;
+	string name;
+	bool urgent = false;
+	double weight = 0;
+};
+
+TEST_CASE("Extracting fields", "") {
+	V8Interpreter v8;
+
+	v8.callWithContext([&]() {
+		auto o = v8.compile("({ id: 7, name: 'job', urgent: 'yes', weight: 1.5 })").run<JSObject>();
+
+		request r;
+		static const JSKey weight("weight");
+		auto result = o.extract(r, &request::id, "id", &request::name, "name", &request::urgent, "urgent", &request::weight, weight);
+		REQUIRE(r.id == 7);
+		REQUIRE(r.name == "job");
+		REQUIRE(r.weight == 1.5);
+		REQUIRE(!result.ok());
+		REQUIRE(result.mismatched == vector<string>({ "urgent" }));
+
+		std::tuple<int, string, double> t;
+		result = o.extract(t, "id", "name", "missing");
+		REQUIRE(std::get<0>(t) == 7);
+		REQUIRE(std::get<1>(t) == "job");
+		REQUIRE(result.missing == vector<string>({ "missing" }));
+
+		// Keys built at run time are looked up without the cache
+		std::string idKey = "i" + std::string("d");
+		r.id = 0;
+		REQUIRE(o.extract(r, &request::id, idKey).ok());
+		REQUIRE(r.id == 7);
+	});
+}
+
+TEST_CASE("Reading arrays", "") {
+	V8Interpreter v8;
+
+	v8.callWithContext([&]() {
+		auto packed = v8.compile("var a = []; for(var i = 0; i < 1000; i++) a.push(i * 0.5); a").run<JSObject>();
+		auto d = packed.as_array<double>();
+		REQUIRE(d.size() == 1000);
+		REQUIRE(d[999] == 499.5);
+
+		auto f = v8.compile("new Float32Array([1, 2, 3])").run<JSObject>().as_array<float>();
+		float sum = 0;
+		for(float x : f)
+			sum += x;
+		REQUIRE(sum == 6);
+	});
+}
+
+TEST_CASE("Object entries", "") {
+	V8Interpreter v8;
+
+	v8.callWithContext([&]() {
+		auto o = v8.compile("({ a: 1, b: 'two', c: 3 })").run<JSObject>();
+		string keys;
+		int sum = 0;
+		for(auto e : o.entries()) {
+			keys += e.key.str();
+			if(e.value.isNumber())
+				sum += e.value.toInt();
+		}
+		REQUIRE(keys == "abc");
+		REQUIRE(sum == 4);
+	});
+}
+
+#ifdef V8_BINDING_STATS
+TEST_CASE("Binding stats", "") {
+	V8Interpreter v8;
+
+	v8.registerFunction("counted", [](int a) -> int { return a; });
+	v8.exec("for(var i = 0; i < 100; i++) counted(i);");
+
+	bool found = false;
+	for(auto &r : BindingStats::collect()) {
+		if(r.name != "counted")
+			continue;
+		found = true;
+		REQUIRE(r.calls == 100);
+		uint64_t inBuckets = 0;
+		for(auto n : r.histogram)
+			inBuckets += n;
+		REQUIRE(inBuckets == 100);
+	}
+	REQUIRE(found);
+}
+#endif
+
+#ifdef V8_CONVERSION_STATS
+struct parcel {
+	double kg = 0;
+};
+
+TEST_CASE("Conversion stats", "") {
+	V8Interpreter v8;
+
+	v8.registerClass<parcel>().field("kg", &parcel::kg);
+	v8.registerFunction("weigh", [](parcel p) -> double { return p.kg; });
+	REQUIRE(v8.exec("weigh({ kg: 2 })") == "2");
+
+	bool found = false;
+	for(auto &r : ConversionStats::top(1000)) {
+		if(r.type != "parcel")
+			continue;
+		found = true;
+		REQUIRE(r.toCpp == 1);
+		REQUIRE(r.bytes == sizeof(parcel));
+		// The temporary wrapper used to set the fields
+		REQUIRE(r.wrappers == 1);
+	}
+	REQUIRE(found);
+}
+#endif
+
+TEST_CASE("CPU profiles", "") {
+	V8Interpreter v8;
+
+	v8.registerFunction("halve", [](float f) -> float { return f / 2; });
+	REQUIRE(v8.exec("halve.name + ',' + halve.map.name") == "halve,halve.map");
+
+	std::string name = "/tmp/v8interpreter_test.cpuprofile";
+	v8.startProfiling("test", 100);
+	v8.exec("function hot() { var s = 0; for(var i = 0; i < 2000000; i++) s += halve(i); return s; } hot()");
+	v8.stopProfiling("test", name);
+
+	std::ifstream is(name);
+	std::string json((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+	REQUIRE(json.find("\"nodes\":[") != std::string::npos);
+	REQUIRE(json.find("\"functionName\":\"hot\"") != std::string::npos);
+	remove(name.c_str());
+
+	REQUIRE_THROWS_AS(v8.stopProfiling("test", name), const v8_exception&);
+}
+
+struct crate {
+	int items = 0;
+};
+
+TEST_CASE("Heap snapshots", "") {
+	V8Interpreter v8;
+
+	v8.registerClass<crate>().field("items", &crate::items);
+	v8.registerFunction("makeCrate", []() -> shared_ptr<crate> { return make_shared<crate>(); });
+	v8.exec("var crates = []; for(var i = 0; i < 10; i++) crates.push(makeCrate());");
+	REQUIRE(WrapperStats::alive<crate>() == 10);
+
+	std::string name = "/tmp/v8interpreter_test.heapsnapshot";
+	v8.writeHeapSnapshot(name);
+	std::ifstream is(name);
+	std::string json((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+	REQUIRE(json.find("\"snapshot\"") != std::string::npos);
+	REQUIRE(json.find("\"crate\"") != std::string::npos);
+	remove(name.c_str());
+}
+
 #endif
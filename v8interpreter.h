@@ -4,6 +4,11 @@
 #include "v8common.h"
 #include "v8cast.h"
 #include "dispatch.h"
+#include "jsfunction.h"
+#include "jsobject.h"
+#include "bindingstats.h"
+#include "heapstats.h"
+#include "watchdog.h"
 
 #include <string>
 #include <functional>
@@ -14,6 +19,8 @@
 #include <assert.h>
 #include <atomic>
 #include <mutex>
+#include <unordered_map>
+#include <ostream>
 
 #define TYPE(x) demangle(typeid(x).name())
 
@@ -29,6 +36,9 @@ template <typename CLASS = void> CLASS * get_this(v8::Local<v8::Value> v) {
 template <typename CLASS, typename T> struct FieldRefBase {
 	virtual void set(CLASS *p, const T &t) = 0;
 	virtual T get(CLASS *p) = 0;
+	// Ids used for call statistics, -1 if not counted
+	int getStatsId = -1;
+	int setStatsId = -1;
 };
 
 // Normal class field access
@@ -89,6 +99,14 @@ template <typename CLASS, typename T> struct OffsetRef : public FieldRefBase<CLA
 	int offset;
 };
 
+// Adapts a field reference to the numeric access used by value mode classes
+template <typename CLASS, typename T, typename C = CLASS> struct ValueFieldRef : public ValueFieldBase<CLASS> {
+	ValueFieldRef(FieldRefBase<C,T> *fr) : fr(fr) {}
+	double get(CLASS *p) override { return fr->get(p); }
+	void set(CLASS *p, double v) override { fr->set(p, static_cast<T>(v)); }
+	FieldRefBase<C,T> *fr;
+};
+
 // CallInfo class used by dispatch.h to get arguments and set return value of call
 class V8CallInfo {
 public:
@@ -102,23 +120,6 @@ public:
 		return to_cpp<T*>(cbi[index]);
 	}
 
-	// Allows js functions to be passed and converted to std::function
-	template <typename ... ARGS> std::function<void(ARGS...)> getArg(int index, std::function<void(ARGS...)>*) const {
-		using namespace v8;
-		auto *isolate = cbi.GetIsolate();
-		auto lf = Local<Function>::Cast(cbi[index]);
-		auto pf = std::make_shared<UniquePersistent<Function>>(isolate, lf);
-		// We create a lambda that calls the provided JS function and return it
-		return [=](ARGS... args) {
-			Isolate::Scope isolate_scope(isolate);
-			HandleScope hs(isolate);
-			auto recv = Null(isolate);
-			Local<Value> arg_array[] = { to_js(isolate, args)... };
-			auto f = Local<Function>::New(isolate, *pf);
-			f->Call(recv, sizeof...(args), arg_array);
-		};
-	}
-
 	template <typename T> void setReturn(T* v) const {
 		using namespace v8;
 		auto *isolate = cbi.GetIsolate();
@@ -142,6 +143,14 @@ public:
 	void setThis(void *t) { thisPtr = t; }
 	void *getThis() const { return thisPtr; }
 
+	void setReturn(v8::Local<v8::Value> v) const {
+		cbi.GetReturnValue().Set(v);
+	}
+
+	v8::Isolate *getIsolate() const { return cbi.GetIsolate(); }
+	int length() const { return cbi.Length(); }
+	v8::Local<v8::Value> arg(int index) const { return cbi[index]; }
+
 
 private:
 	void *thisPtr;
@@ -149,6 +158,116 @@ private:
 };
 
 
+// Native functions registered under the same name. A candidate is selected by argument
+// count first and then by cheap type checks of the arguments. The table is built at
+// registration time, so no argument conversion is tried at call time.
+struct V8Overloads : public FunctionCaller<const V8CallInfo> {
+
+	using ArgCheck = bool (*)(const v8::Local<v8::Value>&);
+
+	struct Candidate {
+		FunctionCaller<const V8CallInfo> *fn;
+		std::vector<ArgCheck> checks;
+	};
+
+	template <class... ARGS> void add(FunctionCaller<const V8CallInfo> *fn, std::tuple<ARGS...>*) {
+		size_t arity = sizeof...(ARGS);
+		if(byArity.size() <= arity)
+			byArity.resize(arity + 1);
+		byArity[arity].push_back(Candidate{ fn, { &JSArgType<typename std::decay<ARGS>::type>::matches... } });
+		if(!first)
+			first = fn;
+		count++;
+	}
+
+	int call(const V8CallInfo &ci) override {
+		size_t n = ci.length();
+		if(n < byArity.size()) {
+			auto &candidates = byArity[n];
+			if(candidates.size() == 1)
+				return candidates[0].fn->call(ci);
+			for(auto &c : candidates) {
+				size_t i = 0;
+				while(i < n && c.checks[i](ci.arg(i)))
+					i++;
+				if(i == n)
+					return c.fn->call(ci);
+			}
+		}
+		// A script error, so it goes to the script as a TypeError
+		auto *isolate = ci.getIsolate();
+		auto msg = std::string("No overload of `") + name + "` matches " + std::to_string(n) + " arguments";
+		isolate->ThrowException(v8::Exception::TypeError(v8::String::NewFromUtf8(isolate, msg.c_str())));
+		return 0;
+	}
+
+	// Only the first vectorizable overload gets a `map`, later ones are dropped
+	void addVectorized(FunctionCaller<const V8CallInfo> *fn) {
+		if(fn && !vectorized)
+			vectorized = fn;
+		else
+			delete fn;
+	}
+
+	// The function to install; the set itself only when there is more than one candidate
+	FunctionCaller<const V8CallInfo> *caller() {
+		return count > 1 ? this : first;
+	}
+
+	std::string name;
+	std::vector<std::vector<Candidate>> byArity;
+	FunctionCaller<const V8CallInfo> *first = nullptr;
+	FunctionCaller<const V8CallInfo> *vectorized = nullptr;
+	int count = 0;
+	bool member = false;
+};
+
+// Runs a scalar numeric function over a whole typed array in one call. Installed as the
+// `map` property of registered functions like `float f(float)`, so `f.map(array)` crosses
+// into C++ once instead of once per element. Takes an optional output array.
+template <class FX, class RET, class ARG> struct VectorCaller : public FunctionCaller<const V8CallInfo> {
+
+	VectorCaller(FX f) : func(f) {}
+
+	int call(const V8CallInfo &ci) override {
+		using namespace v8;
+		if(ci.length() < 1 || !JSTypedArray<ARG>::is(ci.arg(0))) {
+			auto *isolate = ci.getIsolate();
+			auto msg = std::string("map() expects a ") + JSTypedArray<ARG>::name();
+			isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, msg.c_str())));
+			return 0;
+		}
+		auto in = Local<TypedArray>::Cast(ci.arg(0));
+		size_t n = in->Length();
+		Local<TypedArray> out;
+		if(ci.length() > 1 && JSTypedArray<RET>::is(ci.arg(1)) && Local<TypedArray>::Cast(ci.arg(1))->Length() >= n)
+			out = Local<TypedArray>::Cast(ci.arg(1));
+		else
+			out = JSTypedArray<RET>::New(ci.getIsolate(), n);
+		apply(JSTypedArray<ARG>::data(in), JSTypedArray<RET>::data(out), n);
+		ci.setReturn(Local<Value>(out));
+		return 0;
+	}
+
+	// Plain loop so the compiler can vectorize it when `func` can be inlined
+	void apply(const ARG *in, RET *out, size_t n) const {
+		for(size_t i = 0; i < n; i++)
+			out[i] = func(in[i]);
+	}
+
+	FX func;
+};
+
+template <class FX, class ARGS = typename FunctionTraits<FX>::Args, class RET = typename FunctionTraits<FX>::Return, class = void> struct Vectorize {
+	static FunctionCaller<const V8CallInfo> *create(FX f) { return nullptr; }
+};
+
+template <class FX, class ARG, class RET> struct Vectorize<FX, std::tuple<ARG>, RET, typename std::enable_if<JSTypedArray<typename std::decay<ARG>::type>::defined && JSTypedArray<RET>::defined>::type> {
+	static FunctionCaller<const V8CallInfo> *create(FX f) {
+		return new VectorCaller<FX, RET, typename std::decay<ARG>::type>(f);
+	}
+};
+
 //
 //
 template <typename CLASS> struct V8Class {
@@ -171,7 +290,8 @@ template <typename CLASS> struct V8Class {
 		using namespace v8;
 		auto ot = Local<ObjectTemplate>::New(isolate, *otempl);
 		Local<Object> obj = ot->NewInstance();
-		obj->SetAlignedPointerInInternalField(0, ptr);
+		JSClass<CLASS>::wrap(obj, ptr);
+		CONVERSION_STAT(CLASS, wrappers, 1);
 		return obj;
 	}
 
@@ -184,49 +304,42 @@ template <typename CLASS> struct V8Class {
 
 	
 	template <class RET, class... ARGS> V8Class& method(const std::string &name, RET (CLASS::*f)(ARGS...)) {
-		using namespace v8;
-		HandleScope hs(isolate);
-
-		V8FunctionCaller *fn = createFunction<const V8CallInfo>(thisPtr, f);
-
-		Local<Value> data = External::New(isolate, fn);
-
-		auto s = to_js<std::string, String>(isolate, name);
-		auto o = Local<ObjectTemplate>::New(isolate, *otempl);
-
-		Local<FunctionTemplate> ft = FunctionTemplate::New(isolate, callback, data);
-		o->Set(s, ft);
-		return *this;
+		return addMethod(name, createFunction<const V8CallInfo>(thisPtr, f), (std::tuple<ARGS...>*)nullptr, true);
 	}
 
 	template <class RET, class... ARGS> V8Class& method(const std::string &name, RET (CLASS::*f)(ARGS...) const) {
-		using namespace v8;
-		HandleScope hs(isolate);
-
-		V8FunctionCaller *fn = createFunction<const V8CallInfo>(thisPtr, f);
-
-		Local<Value> data = External::New(isolate, fn);
-
-		auto s = to_js<std::string, String>(isolate, name);
-		auto o = Local<ObjectTemplate>::New(isolate, *otempl);
-
-		Local<FunctionTemplate> ft = FunctionTemplate::New(isolate, callback, data);
-		o->Set(s, ft);
-		return *this;
+		return addMethod(name, createFunction<const V8CallInfo>(thisPtr, f), (std::tuple<ARGS...>*)nullptr, true);
 	}
 	
 	template <class RET, class... ARGS> V8Class& method(const std::string &name, RET (*f)(ARGS...)) {
+		return addMethod(name, createFunction<const V8CallInfo>(f), (std::tuple<ARGS...>*)nullptr, false);
+	}
+
+	// Registering a name again adds an overload instead of replacing the method
+	template <class... ARGS> V8Class& addMethod(const std::string &name, V8FunctionCaller *fn, std::tuple<ARGS...> *sig, bool member) {
 		using namespace v8;
 		HandleScope hs(isolate);
 
-		V8FunctionCaller *fn = createFunction<const V8CallInfo>(f);
-
-		Local<Value> data = External::New(isolate, fn);
-
-		auto s = to_js<std::string, String>(isolate, name);
+		auto &ov = overloads[name];
+		// Member overloads need `this` and static ones must not require it, so the two
+		// can not share one callback
+		if(ov.count > 0 && ov.member != member)
+			throw v8_exception(std::string("Can not mix static and member overloads of `") + TYPE(CLASS) + "." + name + "`");
+		if(ov.count == 0)
+			ov.statsId = bindingStatsId(TYPE(CLASS) + "." + name);
+		fn->statsId = ov.statsId;
+		ov.name = name;
+		ov.member = member;
+		ov.add(fn, sig);
+
+		Local<Value> data = External::New(isolate, ov.caller());
+
+		auto s = intern_key(isolate, name);
 		auto o = Local<ObjectTemplate>::New(isolate, *otempl);
 
-		Local<FunctionTemplate> ft = FunctionTemplate::New(isolate, callback_static, data);
+		// Functions instantiated from template properties are named after their key,
+		// so the method shows up under `name` in profiles and stack traces
+		Local<FunctionTemplate> ft = FunctionTemplate::New(isolate, ov.member ? callback : callback_static, data);
 		o->Set(s, ft);
 		return *this;
 	}
@@ -243,6 +356,7 @@ template <typename CLASS> struct V8Class {
 
 		void *ex = v8::External::Cast(*info.Data())->Value();
 		auto *f = static_cast<V8FunctionCaller*>(ex);
+		BINDING_STATS_SCOPE(f->statsId);
 		V8CallInfo ci(info);
 		ci.setThis(p);
 		f->call(ci);
@@ -251,6 +365,7 @@ template <typename CLASS> struct V8Class {
 	static void callback_static(const v8::FunctionCallbackInfo<v8::Value> &info) {
 		void *ex = v8::External::Cast(*info.Data())->Value();
 		auto *f = static_cast<V8FunctionCaller*>(ex);
+		BINDING_STATS_SCOPE(f->statsId);
 		V8CallInfo ci(info);
 		f->call(ci);
 	}
@@ -259,8 +374,10 @@ template <typename CLASS> struct V8Class {
 	template <typename T, typename C> void setAcessor(const std::string &name, FieldRefBase<C, T> *fr, v8::AccessorGetterCallback gcb, v8::AccessorSetterCallback scb) const {
 		using namespace v8;
 		HandleScope hs(isolate);
+		fr->getStatsId = bindingStatsId(TYPE(CLASS) + "." + name + " (get)");
+		fr->setStatsId = bindingStatsId(TYPE(CLASS) + "." + name + " (set)");
 		Local<Value> data = External::New(isolate, fr);
-		auto s = to_js<std::string, String>(isolate, name);
+		auto s = intern_key(isolate, name);
 		auto o = Local<ObjectTemplate>::New(isolate, *otempl);
 		o->SetAccessor(s, gcb, scb, data);
 	}
@@ -277,19 +394,41 @@ template <typename CLASS> struct V8Class {
 	}
 
 	template <typename T, typename C> is_not_class<T, V8Class&> field(const std::string &name, T (C::*ptm)) {
-		setAcessor(name, new FieldRef<C, T>(ptm), get_cb<T>, set_cb<T>);
+		auto *fr = new FieldRef<C, T>(ptm);
+		setAcessor(name, fr, get_cb<T>, set_cb<T>);
+		addValueField<T>(name, fr);
 		return *this;
 	}
 
 	template <typename T> V8Class& field(const std::string &name, int offset) {
-		setAcessor(name, new OffsetRef<CLASS, T>(offset), get_cb<T>, set_cb<T>);
+		auto *fr = new OffsetRef<CLASS, T>(offset);
+		setAcessor(name, fr, get_cb<T>, set_cb<T>);
+		addValueField<T>(name, fr);
 		return *this;
 	}
 	
 	template <class RET> V8Class& field(const std::string &name, RET (CLASS::*getter)(), void (CLASS::*setter)(RET)) {
-		setAcessor(name, new AccessorRef<CLASS, RET>(getter, setter), get_cb<RET>, set_cb<RET>);
+		auto *fr = new AccessorRef<CLASS, RET>(getter, setter);
+		setAcessor(name, fr, get_cb<RET>, set_cb<RET>);
+		addValueField<RET>(name, fr);
+		return *this;
+	}
+
+	// Pass objects of this class by value, as a plain JS object or a packed typed array
+	// built from the numeric fields registered so far. No wrapper or accessors are involved.
+	V8Class& valueMode(ValueMode mode) {
+		static_assert(std::is_trivially_copyable<CLASS>::value, "Value mode requires a trivially copyable class");
+		JSClass<CLASS>::setValueMode(isolate, mode);
 		return *this;
 	}
+
+	// Numeric fields also take part in value mode conversion
+	template <typename T, typename C> is_arithmetic<T, void> addValueField(const std::string &name, FieldRefBase<C, T> *fr) {
+		JSClass<CLASS>::addValueField(name, new ValueFieldRef<CLASS, T, C>(fr));
+	}
+
+	template <typename T, typename C> is_not_arithmetic<T, void> addValueField(const std::string &name, FieldRefBase<C, T> *fr) {
+	}
 	
 	template <typename T> static void get_cb(v8::Local<v8::String> s, const v8::PropertyCallbackInfo<v8::Value> &info) {
 		using namespace v8;
@@ -299,6 +438,7 @@ template <typename CLASS> struct V8Class {
 			throw v8_exception(std::string("No `this` when getting field `") + TYPE(CLASS) + "." + to_cpp<std::string>(s) + "`");
 		auto e = Local<External>::Cast(info.Data());
 		auto *f = static_cast<FieldRefBase<CLASS, T>*>(e->Value());
+		BINDING_STATS_SCOPE(f->getStatsId);
 		auto *isolate = info.GetIsolate();
 		T t = f->get(p);
 		info.GetReturnValue().Set(to_js<T>(isolate, t));
@@ -312,6 +452,7 @@ template <typename CLASS> struct V8Class {
 			throw v8_exception(std::string("No `this` when getting field `") + TYPE(CLASS) + "." + to_cpp<std::string>(s) + "`");
 		auto e = Local<External>::Cast(info.Data());
 		auto *f = static_cast<FieldRefBase<CLASS, T>*>(e->Value());
+		BINDING_STATS_SCOPE(f->setStatsId);
 		f->set(p, to_cpp<T>(val));
 	}
 
@@ -322,9 +463,43 @@ template <typename CLASS> struct V8Class {
 	v8::Isolate *isolate;
 	v8::UniquePersistent<v8::ObjectTemplate> *otempl;
 	CLASS *thisPtr;
+	std::unordered_map<std::string, V8Overloads> overloads;
 };
 
 
+///
+/// \brief Linux perf support, applied to V8 when the first interpreter is created
+/// Only JIT code gets names this way. Native bindings are named by perf from the
+/// C++ symbols of the library.
+///
+struct PerfOptions {
+	// Write /tmp/perf-<pid>.map so `perf report` can name JIT code
+	bool perfMap = false;
+	// Write jit-<pid>.dump for `perf inject --jit`, which also allows annotating JIT code
+	bool jitdump = false;
+};
+
+///
+/// \brief Heap size limits of an interpreter, and what to do when a script gets close to them
+///
+struct HeapLimits {
+	// Sizes in MB, 0 keeps the V8 default
+	size_t semiSpace = 0;
+	size_t oldSpace = 0;
+	size_t codeRange = 0;
+
+	enum NearLimit {
+		// Let V8 abort the process, as it does without a callback
+		Abort,
+		// Raise the limit by `growBy` of the current limit once, then terminate
+		GrowOnce,
+		// Terminate the running script, which throws v8_heap_limit
+		Terminate
+	};
+	NearLimit nearLimit = Abort;
+	double growBy = 0.5;
+};
+
 ///
 /// \brief The V8Interpreter class
 ///
@@ -342,54 +517,31 @@ public:
 
 
 	template <class RET, class... ARGS> void registerFunction(const std::string &name, RET (*f)(ARGS...)) {
-		using namespace v8;
-
-		HandleScope hs(isolate);
-		auto c = Local<Context>::New(isolate, context);
-		Context::Scope context_scope(c);
-
-		V8FunctionCaller *fn = createFunction<const V8CallInfo>(f);
-
-		Local<Value> data = External::New(isolate, fn);
-		Local<FunctionTemplate> ft = FunctionTemplate::New(isolate, callback, data);
-
-		auto fun = ft->GetFunction();
-
-		Handle<Object> v8RealGlobal = Handle<Object>::Cast(c->Global()->GetPrototype());
-
-		v8RealGlobal->Set(to_js<std::string>(isolate, name), fun);
+		addFunction(name, createFunction<const V8CallInfo>(f), (std::tuple<ARGS...>*)nullptr, Vectorize<RET (*)(ARGS...)>::create(f));
 	}
 	
 	template <class FX> void registerFunction(const std::string &name, FX f) {
-		using namespace v8;
-
-		HandleScope hs(isolate); // All Locals go into this scope
-		auto c = Local<Context>::New(isolate, context);
-		Context::Scope context_scope(c);
-
-		V8FunctionCaller *fn = createFunction<const V8CallInfo>(f);
-
-		Local<Value> data = External::New(isolate, fn);
-		Local<FunctionTemplate> ft = FunctionTemplate::New(isolate, callback, data);
-
-		auto fun = ft->GetFunction();
-
-		Handle<Object> v8RealGlobal = Handle<Object>::Cast(c->Global()->GetPrototype());
+		addFunction(name, createFunction<const V8CallInfo>(f), (typename FunctionTraits<FX>::Args*)nullptr, Vectorize<FX>::create(f));
+	}
 
-		v8RealGlobal->Set(to_js<std::string>(isolate, name), fun);
+	// Registering a name again adds an overload instead of replacing the function
+	template <class... ARGS> void addFunction(const std::string &name, V8FunctionCaller *fn, std::tuple<ARGS...> *sig, V8FunctionCaller *vectorized = nullptr) {
+		auto &binding = bindings[name];
+		if(binding.overloads.count == 0)
+			binding.overloads.statsId = bindingStatsId(name);
+		fn->statsId = binding.overloads.statsId;
+		if(vectorized && !binding.overloads.vectorized)
+			vectorized->statsId = bindingStatsId(name + ".map");
+		binding.overloads.name = name;
+		binding.overloads.add(fn, sig);
+		binding.overloads.addVectorized(vectorized);
+		setGlobalFunction(binding);
 	}
 
+	// The object is added to every context, including pooled and leased ones
 	template <class CLASS> void addGlobalObject(const std::string &name, CLASS *ptr) {
-		using namespace v8;
-		HandleScope hs(isolate);
-
-		auto c = Local<Context>::New(isolate, context);
-		Context::Scope context_scope(c);
-
-		auto obj = V8Class<CLASS>::getClass()->createInstance(ptr);
-		Handle<Object> v8RealGlobal = Handle<Object>::Cast(c->Global()->GetPrototype());
-
-		v8RealGlobal->Set(to_js<std::string>(isolate, name), obj);
+		globalObjects.push_back(GlobalObject{ name, [ptr]() { return V8Class<CLASS>::getClass()->createInstance(ptr); } });
+		addGlobalObject(globalObjects.back());
 	}
 
 	template <typename CLASS> V8Class<CLASS>& registerClass(const std::string &name = "", CLASS *thisPtr = nullptr) {
@@ -406,6 +558,63 @@ public:
 		return *sClass;
 	}
 
+	// Get a typed handle to a global JS function. The handle can be called any number
+	// of times without looking up the function again.
+	template <typename F> JSFunction<F> getFunction(const std::string &name) {
+		using namespace v8;
+		Scope scope{ isolate, context };
+		auto c = isolate->GetCurrentContext();
+		auto v = c->Global()->Get(to_key(isolate, name));
+		if(!v->IsFunction())
+			throw v8_exception(std::string("`") + name + "` is not a function");
+		return JSFunction<F>(isolate, c, Local<Function>::Cast(v));
+	}
+
+	// Call `fn` on every element in [begin, end) and write the results to `out`.
+	// The isolate and context are entered once, and each batch of `batchSize` calls
+	// shares one HandleScope; larger batches mean fewer scopes but more live handles.
+	template <typename R, typename T, typename IT, typename OUT> OUT map(const JSFunction<R(T)> &fn, IT begin, IT end, OUT out, size_t batchSize = 256) {
+		using namespace v8;
+		IsolateEntry ie(isolate);
+		HandleScope hs(isolate);
+		ContextEntry ce(isolate, fn.getContext());
+		if(batchSize < 1)
+			batchSize = 1;
+		while(begin != end) {
+			HandleScope batch(isolate);
+			for(size_t i = 0; i < batchSize && begin != end; i++, ++begin)
+				*out++ = to_cpp<R>(fn.call(*begin));
+		}
+		return out;
+	}
+
+	// Compile an expression over named numeric parameters, as in
+	// `compileExpression<bool(double, double, double)>("a * 2 + b > c", { "a", "b", "c" })`.
+	// The expression is arbitrary JS run each time the expression is evaluated, but
+	// it must be a single expression, so it can not close the function it is compiled
+	// into and run code at compile time. Parameters must be identifiers.
+	template <typename F> JSExpression<F> compileExpression(const std::string &expression, const std::vector<std::string> &params) {
+		using namespace v8;
+		if(params.size() != FunctionTraits<F*>::arity)
+			throw v8_exception(std::string("Expression `") + expression + "` needs " + std::to_string(FunctionTraits<F*>::arity) + " parameter names");
+		std::string args;
+		std::string row;
+		for(auto &p : params) {
+			args += ", " + p;
+			row += (row.empty() ? "" : ", ") + p + "[__i]";
+		}
+
+		Scope scope{ isolate, context };
+		auto c = isolate->GetCurrentContext();
+		checkExpression(expression, params);
+		auto fn = compileFunction("return (" + expression + "\n);", params);
+		// The batch loop gets the compiled expression as `__f`, so only names go into its source
+		auto makeBatch = compileFunction("return function(__n, __out" + args + ") { for(var __i = 0; __i < __n; __i++) __out[__i] = __f(" + row + "); };", { "__f" });
+		Local<Value> f = fn;
+		auto batchFn = makeBatch->Call(Undefined(isolate), 1, &f);
+		return JSExpression<F>(isolate, c, fn, Local<Function>::Cast(batchFn));
+	}
+
 	template <class FUNCTOR> void callWithContext(const FUNCTOR &cb) {
 		Scope scope{ isolate, context };
 		cb();
@@ -436,20 +645,149 @@ public:
 		std::string result;
 	};
 
+	///
+	/// \brief A context handed out for one request
+	/// While the lease is alive, exec(), load() and the other calls run in the leased
+	/// context instead of the main one. The context is discarded when the lease is
+	/// released, so nothing a script defines leaks into the next request.
+	///
+	class ContextLease {
+	public:
+		ContextLease(V8Interpreter &v8, v8::UniquePersistent<v8::Context> c);
+		ContextLease(ContextLease &&other);
+		~ContextLease();
+		void release();
+	private:
+		V8Interpreter *v8;
+		// Position of the context this lease replaced on the interpreter's stack
+		size_t depth;
+	};
+
+	///
+	/// \brief A compiled script that can be run many times
+	/// The script is compiled once and not bound to a context. Each run() binds it
+	/// to the interpreter's current context (see acquireContext()) and converts the
+	/// result with to_cpp<T>. A JSObject result goes into the caller's HandleScope, so
+	/// it must be run inside callWithContext() and is valid until that returns; use
+	/// JSObjectRef to keep it longer.
+	///
+	class Script {
+	public:
+		using ScriptHandle = v8::Persistent<v8::UnboundScript, v8::CopyablePersistentTraits<v8::UnboundScript>>;
+
+		Script(V8Interpreter &v8, v8::Local<v8::UnboundScript> s) : v8(&v8), script(v8.isolate, s) {}
+
+		template <typename T = std::string> T run(double timeout = 0) const {
+			JSResultScope<T> scope(v8->isolate, v8->context);
+			return to_cpp<T>(scope.result(v8->runScript(script, timeout)));
+		}
+
+	private:
+		V8Interpreter *v8;
+		ScriptHandle script;
+	};
+
 	V8Interpreter(bool start = true);
+	V8Interpreter(const HeapLimits &limits, bool start = true);
     ~V8Interpreter();
+
+	// V8 flags are process wide, so this must be called before the first interpreter is created
+	static void setPerfOptions(const PerfOptions &options);
+
 	void start();
-	static void callback(const v8::FunctionCallbackInfo<v8::Value> &v);
 
-	std::string load(const std::string &file_name);
-	std::string exec(const std::string &source_code);
+	// Create contexts ahead of time so acquireContext() does not have to. idle()
+	// refills the pool up to `count` as leases use it up.
+	void warmContexts(int count);
+	ContextLease acquireContext();
+
+	static void callback(const v8::FunctionCallbackInfo<v8::Value> &v);
+	static void lazy_get(v8::Local<v8::String> name, const v8::PropertyCallbackInfo<v8::Value> &info);
+	static void lazy_set(v8::Local<v8::String> name, v8::Local<v8::Value> val, const v8::PropertyCallbackInfo<void> &info);
+
+	// A `timeout` in seconds terminates the script when it runs out, throwing v8_timeout.
+	// 0 means no deadline.
+	std::string load(const std::string &file_name, double timeout = 0);
+	std::string exec(const std::string &source_code, double timeout = 0);
+
+	// Limit the total CPU time JS may use in this interpreter, in seconds. Scripts,
+	// JSFunction calls and expression batches all count. Once it is used up, calling
+	// into JS throws v8_timeout. CPU time is only measured while a budget is set.
+	void setCpuBudget(double seconds);
+	double cpuTimeUsed() const;
+	Script compile(const std::string &source_code, const std::string &name = "");
 	void callWithContext(std::function<void()> cb);
 	std::shared_ptr<REPL> startREPL();
+
+	HeapInfo heapStatistics();
+
+	// Give V8 up to `deadlineSeconds` for idle tasks and incremental GC, for hosts
+	// to call in the idle part of their frame or request loop. `lowMemory` does a
+	// full collection instead, which may take longer than the deadline.
+	IdleWork idle(double deadlineSeconds, bool lowMemory = false);
+
+	// Heap usage, GC pauses and live wrappers per class in Prometheus text format
+	void writeMetrics(std::ostream &os);
+	void writeMetrics(const std::string &path);
+
+	// Sample the CPU with V8's profiler. stopProfiling() writes the profile as a
+	// Chrome DevTools .cpuprofile file.
+	void startProfiling(const std::string &name, int samplingIntervalUs = 1000);
+	void stopProfiling(const std::string &name, const std::string &path);
 	
+	// Write a heap snapshot that can be loaded in Chrome DevTools. Objects owned by
+	// JS wrappers are shown as native objects named after their C++ class.
+	void writeHeapSnapshot(const std::string &path);
+
 	static void update();
 
 private:
+	// A registered global function. It is declared as an accessor on the global object and
+	// only turned into a JS function the first time a script reads it.
+	struct GlobalBinding {
+		v8::Local<v8::FunctionTemplate> getTemplate(v8::Isolate *isolate);
+
+		V8Overloads overloads;
+		v8::UniquePersistent<v8::FunctionTemplate> templ;
+	};
+
+	void setGlobalFunction(GlobalBinding &binding);
+	void installBinding(v8::Local<v8::Context> c, GlobalBinding &binding);
+
+	struct GlobalObject {
+		std::string name;
+		std::function<v8::Local<v8::Object>()> create;
+	};
+	std::vector<GlobalObject> globalObjects;
+	void addGlobalObject(GlobalObject &o);
+	void installGlobalObject(v8::Local<v8::Context> c, GlobalObject &o);
+	v8::UniquePersistent<v8::Context> newContext();
+	v8::Local<v8::Value> runScript(const Script::ScriptHandle &script, double timeout = 0);
+	v8::Local<v8::Value> runWatched(v8::Local<v8::Script> script, double timeout);
+	void checkExpression(const std::string &expression, const std::vector<std::string> &params);
+	v8::Local<v8::Function> compileFunction(const std::string &body, const std::vector<std::string> &params);
+
+	static size_t nearHeapLimit(void *data, size_t currentLimit, size_t initialLimit);
+	HeapLimits heapLimits;
+	bool heapGrown = false;
+	ScriptState scriptState;
+
+	static void gcPrologue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags);
+	static void gcEpilogue(v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags);
+	GCStats gcStats;
+
+	// Fresh contexts created from global_templ, waiting to be leased
+	std::vector<v8::UniquePersistent<v8::Context>> contextPool;
+	size_t poolSize = 0;
+	// Contexts replaced by active leases, the innermost last
+	std::vector<v8::UniquePersistent<v8::Context>> leasedFrom;
+	// Set when bindings were added after global_templ was used, so it must be rebuilt
+	// before creating another context
+	bool templateStale = false;
+
+	std::unordered_map<std::string, GlobalBinding> bindings;
 	static v8::Platform *platform;
+	static PerfOptions perfOptions;
 	v8::Isolate *isolate = nullptr;
 	v8::UniquePersistent<v8::Context> context;
 	v8::UniquePersistent<v8::ObjectTemplate> global_templ;
@@ -0,0 +1,204 @@
+#ifndef V8_INTERPRETER_WATCHDOG_H
+#define V8_INTERPRETER_WATCHDOG_H
+
+#include <v8.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
+///
+/// \brief The Watchdog class
+/// One thread shared by all interpreters that terminates scripts running past their
+/// deadline or CPU budget. Deadlines are kept in a timer wheel with `Slots` slots of
+/// `TickMs` each, so adding and removing a deadline is constant time.
+///
+class Watchdog {
+public:
+	static const int TickMs = 10;
+	static const int Slots = 256;
+
+	enum Reason { None, Deadline, CpuBudget };
+
+	///
+	/// \brief Watches the script running on this thread while in scope
+	/// `timeout` is wall clock seconds and `cpuBudget` CPU seconds used by this thread,
+	/// 0 meaning no limit.
+	///
+	class Scope {
+	public:
+		Scope(v8::Isolate *isolate, double timeout, double cpuBudget) : isolate(isolate), cpuLimit(cpuBudget * 1e9) {
+			if(cpuLimit > 0) {
+				pthread_getcpuclockid(pthread_self(), &cpuClock);
+				cpuStart = threadCpuNs(cpuClock);
+			}
+			if(timeout > 0 || cpuLimit > 0)
+				instance().add(this, timeout);
+		}
+
+		~Scope() {
+			stop();
+		}
+
+		// Stop watching, so the script can not be terminated any more. Scopes without
+		// limits were never added and do not touch the shared lock.
+		void stop() {
+			if(watched)
+				instance().remove(this);
+		}
+
+		Scope(const Scope&) = delete;
+		Scope &operator=(const Scope&) = delete;
+
+		Reason fired() const {
+			return reason.load();
+		}
+
+		// CPU time used since the scope was created. Only measured with a CPU budget.
+		double cpuSeconds() const {
+			if(cpuLimit <= 0)
+				return 0;
+			return (threadCpuNs(cpuClock) - cpuStart) / 1e9;
+		}
+
+	private:
+		friend class Watchdog;
+		v8::Isolate *isolate;
+		clockid_t cpuClock;
+		int64_t cpuStart = 0;
+		int64_t cpuLimit;
+		int rounds = 0;
+		int slot = -1;
+		bool watched = false;
+		std::atomic<Reason> reason { None };
+	};
+
+	~Watchdog() {
+		{
+			std::lock_guard<std::mutex> guard(m);
+			quit = true;
+		}
+		cv.notify_one();
+		if(thread.joinable())
+			thread.join();
+	}
+
+private:
+	Watchdog() {}
+
+	static Watchdog &instance() {
+		static Watchdog w;
+		return w;
+	}
+
+	static int64_t threadCpuNs(clockid_t clock) {
+		timespec ts;
+		if(clock_gettime(clock, &ts) != 0)
+			return 0;
+		return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+	void add(Scope *s, double timeout) {
+		std::lock_guard<std::mutex> guard(m);
+		if(timeout > 0) {
+			// Round up so a script never gets less than its timeout
+			int64_t ticks = (int64_t)(timeout * 1000 + TickMs - 1) / TickMs;
+			if(ticks < 1)
+				ticks = 1;
+			s->slot = (current + ticks) % Slots;
+			s->rounds = (ticks - 1) / Slots;
+			wheel[s->slot].push_back(s);
+		}
+		if(s->cpuLimit > 0)
+			cpuWatched.push_back(s);
+		s->watched = true;
+		watchCount++;
+		if(!thread.joinable())
+			thread = std::thread(&Watchdog::run, this);
+		cv.notify_one();
+	}
+
+	void remove(Scope *s) {
+		std::lock_guard<std::mutex> guard(m);
+		if(!s->watched)
+			return;
+		if(s->slot >= 0)
+			erase(wheel[s->slot], s);
+		if(s->cpuLimit > 0)
+			erase(cpuWatched, s);
+		s->watched = false;
+		watchCount--;
+	}
+
+	static void erase(std::vector<Scope*> &v, Scope *s) {
+		for(auto it = v.begin(); it != v.end(); ++it) {
+			if(*it == s) {
+				*it = v.back();
+				v.pop_back();
+				return;
+			}
+		}
+	}
+
+	// Called with the lock held. Terminating is safe from any thread, and the
+	// scope stays registered until its owner removes it.
+	void fire(Scope *s, Reason reason) {
+		if(s->reason.load() != None)
+			return;
+		s->reason = reason;
+		s->isolate->TerminateExecution();
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(m);
+		auto next = std::chrono::steady_clock::now();
+		while(!quit) {
+			if(watchCount == 0) {
+				cv.wait(lock, [this] { return quit || watchCount > 0; });
+				next = std::chrono::steady_clock::now();
+				continue;
+			}
+			next += std::chrono::milliseconds(TickMs);
+			cv.wait_until(lock, next, [this] { return quit; });
+			if(quit)
+				break;
+
+			current = (current + 1) % Slots;
+			auto &slot = wheel[current];
+			for(size_t i = 0; i < slot.size();) {
+				auto *s = slot[i];
+				if(s->rounds-- > 0) {
+					i++;
+					continue;
+				}
+				fire(s, Deadline);
+				s->slot = -1;
+				slot[i] = slot.back();
+				slot.pop_back();
+			}
+
+			for(auto *s : cpuWatched) {
+				if(threadCpuNs(s->cpuClock) - s->cpuStart >= s->cpuLimit)
+					fire(s, CpuBudget);
+			}
+		}
+	}
+
+	std::mutex m;
+	std::condition_variable cv;
+	std::thread thread;
+	bool quit = false;
+	int current = 0;
+	int watchCount = 0;
+	std::vector<Scope*> wheel[Slots];
+	std::vector<Scope*> cpuWatched;
+};
+
+#endif // V8_INTERPRETER_WATCHDOG_H